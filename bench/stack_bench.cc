@@ -0,0 +1,375 @@
+/* Benchmarks of cxx::stack operations, built with Google Benchmark:
+
+    g++ -std=c++20 -O2 -DNDEBUG -I. bench/stack_bench.cc -o stack_bench \
+        -lbenchmark -lpthread
+
+ * Every benchmark reports time/op, allocs/op and bytes/op of the measured
+operations only (setup is excluded) and peak_rss_MB of the whole process.
+ * Arguments are the number of elements and the key cardinality: 0 for
+unique keys, 1 for heavy duplicates (16 distinct keys).
+*/
+#include "stack.h"
+#include "persistent_stack.h"
+
+#include <benchmark/benchmark.h>
+#include <sys/resource.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <cstdlib>
+#include <new>
+#include <numeric>
+#include <random>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace {
+    std::atomic<size_t> alloc_count{0};
+    std::atomic<size_t> alloc_bytes{0};
+
+    void* counted_alloc(size_t n) {
+        alloc_count.fetch_add(1, std::memory_order_relaxed);
+        alloc_bytes.fetch_add(n, std::memory_order_relaxed);
+        if (void* p = std::malloc(n ? n : 1)) {
+            return p;
+        }
+        throw std::bad_alloc();
+    }
+
+    void counted_free(void* p) noexcept {
+        std::free(p);
+    }
+}
+
+// Every replaceable form of operator new and operator delete but the
+// aligned ones, whose library versions allocate and free together.
+void* operator new(size_t n) {
+    return counted_alloc(n);
+}
+
+void* operator new[](size_t n) {
+    return counted_alloc(n);
+}
+
+void operator delete(void* p) noexcept {
+    counted_free(p);
+}
+
+void operator delete[](void* p) noexcept {
+    counted_free(p);
+}
+
+void operator delete(void* p, size_t) noexcept {
+    counted_free(p);
+}
+
+void operator delete[](void* p, size_t) noexcept {
+    counted_free(p);
+}
+
+namespace {
+    constexpr size_t duplicate_keys = 16;
+
+    struct big_value {
+        char data[256] = {};
+        big_value() = default;
+        explicit big_value(size_t i) {
+            data[0] = static_cast<char>(i);
+        }
+    };
+
+    template <typename T> T make(size_t i);
+
+    template <> int make<int>(size_t i) {
+        return static_cast<int>(i);
+    }
+
+    // Long enough not to fit in the small string buffer.
+    template <> std::string make<std::string>(size_t i) {
+        std::string s = std::to_string(i);
+        return std::string(24 - s.size(), 'k') + s;
+    }
+
+    template <> big_value make<big_value>(size_t i) {
+        return big_value(i);
+    }
+
+    // Keys of elements pushed in order, by the cardinality argument.
+    template <typename K>
+    std::vector<K> make_keys(size_t n, bool duplicates) {
+        std::vector<K> keys;
+        keys.reserve(n);
+        for (size_t i = 0; i < n; ++i) {
+            keys.push_back(make<K>(duplicates ? i % duplicate_keys : i));
+        }
+        return keys;
+    }
+
+    template <typename Stack, typename K, typename V>
+    Stack make_stack(const std::vector<K>& keys) {
+        Stack s;
+        for (size_t i = 0; i < keys.size(); ++i) {
+            s.push(keys[i], make<V>(i));
+        }
+        return s;
+    }
+
+    // Counts allocations of the measured parts of a benchmark.
+    class measure {
+    public:
+        void start() noexcept {
+            count0 = alloc_count.load(std::memory_order_relaxed);
+            bytes0 = alloc_bytes.load(std::memory_order_relaxed);
+        }
+        void stop() noexcept {
+            count += alloc_count.load(std::memory_order_relaxed) - count0;
+            bytes += alloc_bytes.load(std::memory_order_relaxed) - bytes0;
+        }
+        void report(benchmark::State& state, double ops) const {
+            using benchmark::Counter;
+            rusage usage{};
+            getrusage(RUSAGE_SELF, &usage);
+            state.counters["time/op"] =
+                    Counter(ops, Counter::kIsRate | Counter::kInvert);
+            state.counters["allocs/op"] = static_cast<double>(count) / ops;
+            state.counters["bytes/op"] = static_cast<double>(bytes) / ops;
+            state.counters["peak_rss_MB"] =
+                    static_cast<double>(usage.ru_maxrss) / 1024;
+        }
+    private:
+        size_t count0 = 0, bytes0 = 0, count = 0, bytes = 0;
+    };
+
+    template <typename Stack, typename K, typename V>
+    void bm_push(benchmark::State& state) {
+        const auto keys = make_keys<K>(state.range(0), state.range(1));
+        std::vector<V> values;
+        for (size_t i = 0; i < keys.size(); ++i) {
+            values.push_back(make<V>(i));
+        }
+        measure m;
+        for (auto _ : state) {
+            Stack s;
+            m.start();
+            for (size_t i = 0; i < keys.size(); ++i) {
+                s.push(keys[i], values[i]);
+            }
+            m.stop();
+            state.PauseTiming();
+            s = Stack();
+            state.ResumeTiming();
+        }
+        m.report(state, static_cast<double>(state.iterations() * keys.size()));
+    }
+
+    template <typename Stack, typename K, typename V>
+    void bm_pop(benchmark::State& state) {
+        const auto keys = make_keys<K>(state.range(0), state.range(1));
+        measure m;
+        for (auto _ : state) {
+            state.PauseTiming();
+            Stack s = make_stack<Stack, K, V>(keys);
+            state.ResumeTiming();
+            m.start();
+            for (size_t i = 0; i < keys.size(); ++i) {
+                s.pop();
+            }
+            m.stop();
+        }
+        m.report(state, static_cast<double>(state.iterations() * keys.size()));
+    }
+
+    template <typename Stack, typename K, typename V>
+    void bm_pop_key(benchmark::State& state) {
+        const auto keys = make_keys<K>(state.range(0), state.range(1));
+        std::vector<K> order = keys;
+        std::shuffle(order.begin(), order.end(), std::mt19937(1));
+        measure m;
+        for (auto _ : state) {
+            state.PauseTiming();
+            Stack s = make_stack<Stack, K, V>(keys);
+            state.ResumeTiming();
+            m.start();
+            for (const K& k : order) {
+                s.pop(k);
+            }
+            m.stop();
+        }
+        m.report(state, static_cast<double>(state.iterations() * keys.size()));
+    }
+
+    template <typename Stack, typename K, typename V>
+    void bm_front_key(benchmark::State& state) {
+        const auto keys = make_keys<K>(state.range(0), state.range(1));
+        const Stack s = make_stack<Stack, K, V>(keys);
+        size_t i = 0;
+        measure m;
+        m.start();
+        for (auto _ : state) {
+            benchmark::DoNotOptimize(&s.front(keys[i]));
+            i = i + 1 == keys.size() ? 0 : i + 1;
+        }
+        m.stop();
+        m.report(state, static_cast<double>(state.iterations()));
+    }
+
+    template <typename Stack, typename K, typename V>
+    void bm_count(benchmark::State& state) {
+        const auto keys = make_keys<K>(state.range(0), state.range(1));
+        const Stack s = make_stack<Stack, K, V>(keys);
+        size_t i = 0;
+        measure m;
+        m.start();
+        for (auto _ : state) {
+            benchmark::DoNotOptimize(s.count(keys[i]));
+            i = i + 1 == keys.size() ? 0 : i + 1;
+        }
+        m.stop();
+        m.report(state, static_cast<double>(state.iterations()));
+    }
+
+    // One op is a step of the iterator to the next key.
+    template <typename Stack, typename K, typename V>
+    void bm_iterate_keys(benchmark::State& state) {
+        const auto keys = make_keys<K>(state.range(0), state.range(1));
+        const Stack s = make_stack<Stack, K, V>(keys);
+        size_t steps = 0;
+        measure m;
+        m.start();
+        for (auto _ : state) {
+            for (auto it = s.cbegin(); it != s.cend(); ++it) {
+                benchmark::DoNotOptimize(&*it);
+                ++steps;
+            }
+        }
+        m.stop();
+        m.report(state, static_cast<double>(std::max<size_t>(steps, 1)));
+    }
+
+    // Copy of a shareable stack, which shares its data.
+    template <typename Stack, typename K, typename V>
+    void bm_copy(benchmark::State& state) {
+        const auto keys = make_keys<K>(state.range(0), state.range(1));
+        const Stack s = make_stack<Stack, K, V>(keys);
+        measure m;
+        m.start();
+        for (auto _ : state) {
+            Stack c(s);
+            benchmark::DoNotOptimize(&c);
+        }
+        m.stop();
+        m.report(state, static_cast<double>(state.iterations()));
+    }
+
+    // Copy of a stack marked unshareable by a non-const front.
+    template <typename Stack, typename K, typename V>
+    void bm_copy_unshareable(benchmark::State& state) {
+        const auto keys = make_keys<K>(state.range(0), state.range(1));
+        Stack s = make_stack<Stack, K, V>(keys);
+        benchmark::DoNotOptimize(&s.front().second);
+        measure m;
+        for (auto _ : state) {
+            m.start();
+            Stack c(s);
+            m.stop();
+            state.PauseTiming();
+            c = Stack();
+            state.ResumeTiming();
+        }
+        m.report(state, static_cast<double>(state.iterations()));
+    }
+
+    // First modification of a copy, which copies the shared data.
+    template <typename Stack, typename K, typename V>
+    void bm_cow_fault(benchmark::State& state) {
+        const auto keys = make_keys<K>(state.range(0), state.range(1));
+        const Stack s = make_stack<Stack, K, V>(keys);
+        const K k = keys.front();
+        const V v = make<V>(0);
+        measure m;
+        for (auto _ : state) {
+            state.PauseTiming();
+            Stack c(s);
+            state.ResumeTiming();
+            m.start();
+            c.push(k, v);
+            m.stop();
+            state.PauseTiming();
+            c = Stack();
+            state.ResumeTiming();
+        }
+        m.report(state, static_cast<double>(state.iterations()));
+    }
+
+    // Push of unique keys which differ only above the stride bit, such as
+    // aligned ids or pointers. The argument is the stride in bits.
+    template <typename Stack>
+    void bm_push_strided(benchmark::State& state) {
+        constexpr size_t n = 1 << 14;
+        std::vector<std::uint64_t> keys;
+        for (size_t i = 0; i < n; ++i) {
+            keys.push_back(static_cast<std::uint64_t>(i) << state.range(0));
+        }
+        measure m;
+        for (auto _ : state) {
+            Stack s;
+            m.start();
+            for (size_t i = 0; i < n; ++i) {
+                s.push(keys[i], static_cast<int>(i));
+            }
+            m.stop();
+            state.PauseTiming();
+            s = Stack();
+            state.ResumeTiming();
+        }
+        m.report(state, static_cast<double>(state.iterations() * n));
+    }
+
+    void strides(benchmark::internal::Benchmark* b) {
+        for (long stride : {0, 16, 20, 32}) {
+            b->Arg(stride);
+        }
+        b->ArgName("stride");
+    }
+
+    void sizes(benchmark::internal::Benchmark* b) {
+        for (long n : {1L << 10, 1L << 14, 1L << 17}) {
+            for (long duplicates : {0, 1}) {
+                b->Args({n, duplicates});
+            }
+        }
+        b->ArgNames({"n", "dup"});
+    }
+
+    using list_map = cxx::stack<int, int>;
+    using slot_hash = cxx::stack<int, int, cxx::slot_storage,
+                                 cxx::hashed_index>;
+    using string_key = cxx::stack<std::string, int>;
+    using big_val = cxx::stack<int, big_value>;
+    using persistent = cxx::persistent_stack<int, int>;
+    using ordered_u64 = cxx::stack<std::uint64_t, int>;
+    using hashed_u64 = cxx::stack<std::uint64_t, int, cxx::hashed_index>;
+}
+
+#define STACK_BENCHMARKS(op)                                                  \
+    BENCHMARK_TEMPLATE(op, list_map, int, int)->Apply(sizes);                 \
+    BENCHMARK_TEMPLATE(op, slot_hash, int, int)->Apply(sizes);                \
+    BENCHMARK_TEMPLATE(op, string_key, std::string, int)->Apply(sizes);       \
+    BENCHMARK_TEMPLATE(op, big_val, int, big_value)->Apply(sizes);            \
+    BENCHMARK_TEMPLATE(op, persistent, int, int)->Apply(sizes)
+
+STACK_BENCHMARKS(bm_push);
+STACK_BENCHMARKS(bm_pop);
+STACK_BENCHMARKS(bm_pop_key);
+STACK_BENCHMARKS(bm_front_key);
+STACK_BENCHMARKS(bm_count);
+STACK_BENCHMARKS(bm_iterate_keys);
+STACK_BENCHMARKS(bm_copy);
+STACK_BENCHMARKS(bm_copy_unshareable);
+STACK_BENCHMARKS(bm_cow_fault);
+BENCHMARK_TEMPLATE(bm_push_strided, ordered_u64)->Apply(strides);
+BENCHMARK_TEMPLATE(bm_push_strided, hashed_u64)->Apply(strides);
+
+BENCHMARK_MAIN();
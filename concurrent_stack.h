@@ -0,0 +1,98 @@
+#ifndef CONCURRENT_STACK_H
+#define CONCURRENT_STACK_H
+
+#include <atomic>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <utility>
+
+#include "stack.h"
+
+namespace cxx {
+    /* Stack shared by writers and any number of readers, in the style of RCU.
+     * Readers take an immutable snapshot, which costs one load of an
+    std::atomic<std::shared_ptr>, and use its const interface (front,
+    front(k), count, size, cbegin/cend) without further synchronization.
+    A snapshot never changes while it is held, snapshots may also be
+    copied into ordinary stacks.
+
+     * Writers apply modifications to a copy of the last snapshot and
+    publish the result as the next one, with one store to the atomic
+    shared_ptr: every reader sees either the old or the new version, so
+    publication is linearizable. Writers take a mutex, which readers never
+    take. The atomic shared_ptr is not lock-free in libstdc++
+    (is_lock_free() is false), its loads and stores take a short internal
+    lock, so readers are not lock-free either. Each modification gives
+    the guarantee of Stack, if it throws nothing is published.
+
+     * Copy on write makes the copy O(1), but the first modification of it
+    copies the data shared with the snapshot: O(n) for cxx::stack and
+    O(log n) for cxx::persistent_stack, which can be used as Stack. Use
+    update() to publish several modifications at once.
+
+     * Data reachable from a published snapshot is never modified in place,
+    as the snapshot holds a reference to it and so it is always copied on
+    write first. Readers copying a snapshot only add such references.
+    */
+    template <typename K, typename V, typename Stack = stack<K, V>>
+    class concurrent_stack {
+    public:
+        using stack_type = Stack;
+        using snapshot_type = std::shared_ptr<const Stack>;
+
+        concurrent_stack() : concurrent_stack(Stack()) {}
+
+        explicit concurrent_stack(const Stack& initial)
+                : current(std::make_shared<const Stack>(initial)) {}
+
+        concurrent_stack(const concurrent_stack&) = delete;
+        concurrent_stack& operator=(const concurrent_stack&) = delete;
+
+        // Last published version, safe to call from any thread.
+        snapshot_type snapshot() const noexcept {
+            return current.load(std::memory_order_acquire);
+        }
+
+        /* Calls fn(Stack&) with a copy of the last snapshot and publishes
+        the result as one version. Readers see either none or all of the
+        modifications made by fn. Strong exception guarantee.
+        */
+        template <typename Fn>
+        void update(Fn&& fn) {
+            std::lock_guard<std::mutex> lock(writer);
+            Stack next(*current.load(std::memory_order_relaxed));
+            std::invoke(std::forward<Fn>(fn), next);
+            // Copied rather than moved: the copy does not share values which
+            // fn may still reference through a non-const front.
+            current.store(std::make_shared<const Stack>(next),
+                          std::memory_order_release);
+        }
+
+        void push(const K& k, const V& v) {
+            update([&](Stack& s) { s.push(k, v); });
+        }
+
+        void push(K&& k, V&& v) {
+            update([&](Stack& s) { s.push(std::move(k), std::move(v)); });
+        }
+
+        void pop() {
+            update([](Stack& s) { s.pop(); });
+        }
+
+        void pop(const K& k) {
+            update([&](Stack& s) { s.pop(k); });
+        }
+
+        void clear() {
+            update([](Stack& s) { s.clear(); });
+        }
+
+    private:
+        std::mutex writer;
+        std::atomic<snapshot_type> current;
+    };
+}
+
+#endif //CONCURRENT_STACK_H
@@ -0,0 +1,106 @@
+#ifndef FROZEN_STACK_H
+#define FROZEN_STACK_H
+
+#include <cstddef>
+#include <span>
+#include <stdexcept>
+#include <utility>
+#include <vector>
+
+#include "stack.h"
+
+namespace cxx {
+    /* Immutable stack made by cxx::stack::freeze() for read-mostly data.
+     * Keys are kept once, sorted in one contiguous array. Values are kept
+    in one flat array, grouped by key and each group ordered from the
+    newest value, offsets[i] is where the group of keys[i] begins. There
+    are no nodes and no pointers, only three allocations in total.
+     * count(k), front(k) and equal_range(k) binary search the keys with a
+    branch-free lower bound, front() and size() take O(1), cbegin/cend
+    iterate over the sorted keys. K must have <.
+     * Only the top element is known of the order of the stack, below it
+    values are grouped by key.
+    */
+    template <typename K, typename V>
+    class frozen_stack {
+    public:
+        using const_iterator = const K*;
+
+        frozen_stack() = default;
+
+        size_t size() const noexcept {
+            return values.size();
+        }
+
+        size_t count(const K& k) const {
+            const size_t i = find(k);
+            return i == npos ? 0 : offsets[i + 1] - offsets[i];
+        }
+
+        std::pair<const K&, const V&> front() const {
+            if (values.empty()) {
+                throw std::invalid_argument("Error: empty stack");
+            }
+            return std::pair<const K&, const V&>(keys[top],
+                                                 values[offsets[top]]);
+        }
+
+        const V& front(const K& k) const {
+            const size_t i = find(k);
+            if (i == npos) {
+                throw std::invalid_argument(
+                        "Error: stack does not contain given key");
+            }
+            return values[offsets[i]];
+        }
+
+        // Values with key k from the newest, empty if there are none.
+        std::span<const V> equal_range(const K& k) const {
+            const size_t i = find(k);
+            if (i == npos) {
+                return {};
+            }
+            return {values.data() + offsets[i], offsets[i + 1] - offsets[i]};
+        }
+
+        const_iterator cbegin() const noexcept {
+            return keys.data();
+        }
+
+        const_iterator cend() const noexcept {
+            return keys.data() + keys.size();
+        }
+
+    private:
+        template <typename, typename, typename...> friend class stack;
+
+        static constexpr size_t npos = static_cast<size_t>(-1);
+
+        std::vector<K> keys;
+        std::vector<size_t> offsets; // keys.size() + 1 of them if not empty.
+        std::vector<V> values;
+        size_t top = 0; // Index of the key of the top element.
+
+        // Index of k in keys or npos. The loop has a fixed number of steps
+        // for a size and no branch on the comparison.
+        size_t find(const K& k) const {
+            if (keys.empty()) {
+                return npos;
+            }
+            const K* base = keys.data();
+            size_t n = keys.size();
+            while (n > 1) {
+                const size_t half = n / 2;
+                base = base[half] < k ? base + half : base;
+                n -= half;
+            }
+            base += *base < k;
+            if (base == keys.data() + keys.size() || k < *base) {
+                return npos;
+            }
+            return static_cast<size_t>(base - keys.data());
+        }
+    };
+}
+
+#endif //FROZEN_STACK_H
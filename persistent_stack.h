@@ -0,0 +1,536 @@
+#ifndef PERSISTENT_STACK_H
+#define PERSISTENT_STACK_H
+
+#include "stack.h"
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <iterator>
+#include <memory>
+#include <set>
+#include <stdexcept>
+#include <tuple>
+#include <utility>
+
+namespace cxx {
+    namespace detail {
+        /* Persistent AVL tree.
+         * A node is never modified once it may be shared: an update copies
+        the path from the root to the changed node (O(log n) new nodes) and
+        shares the rest with the old tree. Updates return a new root and keep
+        the old one valid, so they give the strong exception guarantee.
+
+         * Key and T are expected to be cheap to copy (integers, shared_ptr),
+        every copied node copies them.
+        */
+        template <typename Key, typename T, typename Compare>
+        class persistent_tree {
+        public:
+            struct node;
+            using node_ptr = std::shared_ptr<node>;
+
+            struct node {
+                Key key;
+                T value;
+                node_ptr left;
+                node_ptr right;
+                int height;
+            };
+
+            // Bound on the height, an AVL tree that high has over 10^13 nodes.
+            static constexpr size_t max_height = 64;
+
+            template <typename KeyArg>
+            static const node* find(const node* t, const KeyArg& k) {
+                while (t) {
+                    if (Compare()(k, t->key)) {
+                        t = t->left.get();
+                    }
+                    else if (Compare()(t->key, k)) {
+                        t = t->right.get();
+                    }
+                    else {
+                        return t;
+                    }
+                }
+                return nullptr;
+            }
+
+            static const node* max(const node* t) noexcept {
+                while (t && t->right) {
+                    t = t->right.get();
+                }
+                return t;
+            }
+
+            // Inserts (k, v), or replaces the value if k is present.
+            static node_ptr insert(const node_ptr& t, const Key& k, const T& v) {
+                if (!t) {
+                    return make(k, v, nullptr, nullptr);
+                }
+                if (Compare()(k, t->key)) {
+                    return balance(t->key, t->value, insert(t->left, k, v),
+                                   t->right);
+                }
+                if (Compare()(t->key, k)) {
+                    return balance(t->key, t->value, t->left,
+                                   insert(t->right, k, v));
+                }
+                return make(t->key, v, t->left, t->right);
+            }
+
+            // Removes k, which must be present.
+            template <typename KeyArg>
+            static node_ptr erase(const node_ptr& t, const KeyArg& k) {
+                if (Compare()(k, t->key)) {
+                    return balance(t->key, t->value, erase(t->left, k),
+                                   t->right);
+                }
+                if (Compare()(t->key, k)) {
+                    return balance(t->key, t->value, t->left,
+                                   erase(t->right, k));
+                }
+                if (!t->left) {
+                    return t->right;
+                }
+                if (!t->right) {
+                    return t->left;
+                }
+                const node* m = t->right.get();
+                while (m->left) {
+                    m = m->left.get();
+                }
+                return balance(m->key, m->value, t->left, erase_min(t->right));
+            }
+
+            // Removes the greatest key of a non-empty tree.
+            static node_ptr erase_max(const node_ptr& t) {
+                if (!t->right) {
+                    return t->left;
+                }
+                return balance(t->key, t->value, t->left, erase_max(t->right));
+            }
+
+            /* Returns the value of k (which must be present) for modification.
+            Shared nodes on the path are replaced with copies first. The tree
+            keeps its content even if a copy throws.
+            */
+            template <typename KeyArg>
+            static T& unshare(node_ptr& t, const KeyArg& k) {
+                node_ptr* cur = &t;
+                while (true) {
+                    if (cur->use_count() > 1) {
+                        *cur = std::make_shared<node>(**cur);
+                    }
+                    node& n = **cur;
+                    if (Compare()(k, n.key)) {
+                        cur = &n.left;
+                    }
+                    else if (Compare()(n.key, k)) {
+                        cur = &n.right;
+                    }
+                    else {
+                        return n.value;
+                    }
+                }
+            }
+
+        private:
+            static int height(const node_ptr& t) noexcept {
+                return t ? t->height : 0;
+            }
+
+            static node_ptr make(const Key& k, const T& v, node_ptr l,
+                                 node_ptr r) {
+                const int h = 1 + std::max(height(l), height(r));
+                return std::make_shared<node>(
+                        node{k, v, std::move(l), std::move(r), h});
+            }
+
+            static node_ptr balance(const Key& k, const T& v, node_ptr l,
+                                    node_ptr r) {
+                if (height(l) > height(r) + 1) {
+                    if (height(l->left) >= height(l->right)) {
+                        return make(l->key, l->value, l->left,
+                                    make(k, v, l->right, std::move(r)));
+                    }
+                    const node& lr = *l->right;
+                    return make(lr.key, lr.value,
+                                make(l->key, l->value, l->left, lr.left),
+                                make(k, v, lr.right, std::move(r)));
+                }
+                if (height(r) > height(l) + 1) {
+                    if (height(r->right) >= height(r->left)) {
+                        return make(r->key, r->value,
+                                    make(k, v, std::move(l), r->left),
+                                    r->right);
+                    }
+                    const node& rl = *r->left;
+                    return make(rl.key, rl.value,
+                                make(k, v, std::move(l), rl.left),
+                                make(r->key, r->value, rl.right, r->right));
+                }
+                return make(k, v, std::move(l), std::move(r));
+            }
+
+            static node_ptr erase_min(const node_ptr& t) {
+                if (!t->left) {
+                    return t->right;
+                }
+                return balance(t->key, t->value, erase_min(t->left), t->right);
+            }
+        };
+    }
+
+    /* Variant of cxx::stack with structurally shared (persistent) data.
+     * Copies share everything, a modification of a shared stack copies only
+    O(log n) tree nodes instead of the whole stack. push, pop, pop(K const &),
+    front(K const &), count and non-const front take O(log n), const front
+    takes O(1). Public interface and exception guarantees are those of
+    cxx::stack.
+
+     * Data structure:
+     * order: tree from sequence number of an element to the element, the top
+    of the stack has the greatest number.
+     * keys: tree from key to the chain of sequence numbers of elements with
+    that key (newest first, cells shared between versions) and its length.
+     * Elements are shared by versions until modified through front, there is
+    only 1 copy of each key.
+    */
+    template <typename K, typename V> class persistent_stack {
+    private:
+        template <typename P>
+        using shared_ptr = std::shared_ptr<P>;
+
+        struct element {
+            shared_ptr<K> key;
+            V value;
+
+            template <typename... VArgs>
+            explicit element(shared_ptr<K> k, VArgs&&... v)
+                    : key(std::move(k)), value(std::forward<VArgs>(v)...) {}
+        };
+
+        struct chain_cell {
+            std::uint64_t seq;
+            shared_ptr<chain_cell> next;
+
+            chain_cell(std::uint64_t s, shared_ptr<chain_cell> n) noexcept
+                    : seq(s), next(std::move(n)) {}
+            chain_cell(const chain_cell&) = delete;
+
+            // Long chains are released iteratively, not recursively.
+            ~chain_cell() {
+                shared_ptr<chain_cell> n = std::move(next);
+                while (n && n.use_count() == 1) {
+                    n = std::move(n->next);
+                }
+            }
+        };
+
+        struct key_entry {
+            shared_ptr<chain_cell> top;
+            size_t count;
+        };
+
+        using order_tree = detail::persistent_tree<std::uint64_t,
+                shared_ptr<element>, std::less<std::uint64_t>>;
+        using key_tree = detail::persistent_tree<shared_ptr<K>, key_entry,
+                detail::key_less<K>>;
+
+        typename order_tree::node_ptr order;
+        typename key_tree::node_ptr keys;
+        const element* top_element; // Cached greatest element of order.
+        size_t elements;
+        std::uint64_t next_seq;
+        bool shareable; // Whether references returned by non-const front are out.
+        std::set<std::uint64_t> exposed; // Elements returned by non-const front.
+
+        void swap(persistent_stack& other) noexcept {
+            std::swap(order, other.order);
+            std::swap(keys, other.keys);
+            std::swap(top_element, other.top_element);
+            std::swap(elements, other.elements);
+            std::swap(next_seq, other.next_seq);
+            std::swap(shareable, other.shareable);
+            std::swap(exposed, other.exposed);
+        }
+
+        void modified() noexcept {
+            const auto* top = order_tree::max(order.get());
+            top_element = top ? top->value.get() : nullptr;
+            shareable = true;
+            exposed.clear();
+        }
+
+        template <typename KArg, typename... VArgs>
+        void push_impl(KArg&& k, VArgs&&... v) {
+            const auto* key_node = key_tree::find(keys.get(), std::as_const(k));
+            shared_ptr<K> key = key_node ? key_node->key
+                                         : std::make_shared<K>(
+                                                 std::forward<KArg>(k));
+            auto new_order = order_tree::insert(
+                    order, next_seq,
+                    std::make_shared<element>(key, std::forward<VArgs>(v)...));
+            auto cell = std::make_shared<chain_cell>(
+                    next_seq, key_node ? key_node->value.top : nullptr);
+            auto new_keys = key_tree::insert(
+                    keys, key,
+                    key_entry{std::move(cell),
+                              key_node ? key_node->value.count + 1 : 1});
+
+            order = std::move(new_order);
+            keys = std::move(new_keys);
+            ++elements;
+            ++next_seq;
+            modified();
+        }
+
+        // Removes the newest element with the key of key_node, new_order is
+        // the order tree without that element.
+        void remove_top_of(const typename key_tree::node* key_node,
+                           typename order_tree::node_ptr new_order) {
+            const key_entry& entry = key_node->value;
+            auto new_keys = entry.count == 1
+                            ? key_tree::erase(keys, key_node->key)
+                            : key_tree::insert(keys, key_node->key,
+                                               key_entry{entry.top->next,
+                                                         entry.count - 1});
+            order = std::move(new_order);
+            keys = std::move(new_keys);
+            --elements;
+            modified();
+        }
+
+        // Unshares the element with sequence number seq for modification.
+        V& unshare_value(std::uint64_t seq) {
+            shared_ptr<element>& e = order_tree::unshare(order, seq);
+            if (e.use_count() > 1) {
+                const bool top = e.get() == top_element;
+                e = std::make_shared<element>(*e);
+                if (top) {
+                    top_element = e.get();
+                }
+            }
+            return e->value;
+        }
+
+        // Unshares the element and hands out a reference to its value.
+        V& expose(std::uint64_t seq) {
+            V& value = unshare_value(seq);
+            exposed.insert(seq);
+            shareable = false;
+            return value;
+        }
+
+        const typename key_tree::node* find_key(const K& k) const {
+            const auto* key_node = key_tree::find(keys.get(), k);
+            if (!key_node) {
+                throw std::invalid_argument(
+                        "Error: stack does not contain given key");
+            }
+            return key_node;
+        }
+
+    public:
+        persistent_stack() noexcept : order(), keys(), top_element(nullptr),
+                                      elements(0),
+                                      next_seq(0), shareable(true) {}
+
+        // O(1), plus O(log n) for every distinct element returned by
+        // non-const front of other since its last modification.
+        persistent_stack(const persistent_stack& other)
+                : order(other.order), keys(other.keys),
+                  top_element(other.top_element), elements(other.elements),
+                  next_seq(other.next_seq), shareable(true) {
+            if (!other.shareable) {
+                for (std::uint64_t seq : other.exposed) {
+                    shared_ptr<element>& e = order_tree::unshare(order, seq);
+                    e = std::make_shared<element>(*e);
+                }
+                top_element = order_tree::max(order.get())->value.get();
+            }
+        }
+
+        persistent_stack(persistent_stack&& other) noexcept
+                : order(std::move(other.order)), keys(std::move(other.keys)),
+                  top_element(other.top_element), elements(other.elements), next_seq(other.next_seq),
+                  shareable(other.shareable),
+                  exposed(std::move(other.exposed)) {
+            other.top_element = nullptr;
+            other.elements = 0;
+            other.shareable = true;
+            other.exposed.clear();
+        }
+
+        persistent_stack& operator=(persistent_stack other) noexcept {
+            swap(other);
+            return *this;
+        }
+
+        void push(const K& k, const V& v) {
+            push_impl(k, v);
+        }
+
+        void push(K&& k, V&& v) {
+            push_impl(std::move(k), std::move(v));
+        }
+
+        template <typename... KArgs, typename... VArgs>
+        void emplace(std::piecewise_construct_t,
+                     std::tuple<KArgs...> key_args,
+                     std::tuple<VArgs...> value_args) {
+            K key = std::make_from_tuple<K>(std::move(key_args));
+            std::apply([this, &key](auto&&... v) {
+                push_impl(std::move(key), std::forward<decltype(v)>(v)...);
+            }, std::move(value_args));
+        }
+
+        void pop() {
+            if (!elements) {
+                throw std::invalid_argument("Error: Empty stack");
+            }
+            const auto* top = order_tree::max(order.get());
+            remove_top_of(key_tree::find(keys.get(), top->value->key),
+                          order_tree::erase_max(order));
+        }
+
+        void pop(const K& k) {
+            const auto* key_node = key_tree::find(keys.get(), k);
+            if (!key_node) {
+                throw std::invalid_argument(
+                        "Error: Element with key k does not exist");
+            }
+            remove_top_of(key_node,
+                          order_tree::erase(order, key_node->value.top->seq));
+        }
+
+        std::pair<const K&, const V&> front() const {
+            if (!elements) {
+                throw std::invalid_argument("Error: empty stack");
+            }
+            return std::pair<const K&, const V&>(*top_element->key,
+                                                 top_element->value);
+        }
+
+        std::pair<const K&, V&> front() {
+            if (!elements) {
+                throw std::invalid_argument("Error: empty stack");
+            }
+            const auto* top = order_tree::max(order.get());
+            const K& key = *top->value->key;
+            return std::pair<const K&, V&>(key, expose(top->key));
+        }
+
+        V& front(const K& k) {
+            return expose(find_key(k)->value.top->seq);
+        }
+
+        // As in cxx::stack: fn(V&) is called with the top value, the stack
+        // stays shareable. If fn throws, the value is as fn left it. O(log n).
+        template <typename Fn>
+        auto modify_front(Fn&& fn) {
+            if (!elements) {
+                throw std::invalid_argument("Error: empty stack");
+            }
+            return std::invoke(std::forward<Fn>(fn), unshare_value(
+                    order_tree::max(order.get())->key));
+        }
+
+        template <typename Fn>
+        auto modify(const K& k, Fn&& fn) {
+            return std::invoke(std::forward<Fn>(fn), unshare_value(
+                    find_key(k)->value.top->seq));
+        }
+
+        const V& front(const K& k) const {
+            const std::uint64_t seq = find_key(k)->value.top->seq;
+            return order_tree::find(order.get(), seq)->value->value;
+        }
+
+        size_t size() const noexcept {
+            return elements;
+        }
+
+        size_t count(const K& k) const {
+            const auto* key_node = key_tree::find(keys.get(), k);
+            return key_node ? key_node->value.count : 0;
+        }
+
+        void clear() noexcept {
+            order.reset();
+            keys.reset();
+            elements = 0;
+            modified();
+        }
+
+        // Iterates keys in increasing order, invalidated by modifications.
+        class const_iterator {
+        public:
+            using iterator_category = std::forward_iterator_tag;
+            using value_type = K;
+            using difference_type = ptrdiff_t;
+            using pointer = const value_type*;
+            using reference = const value_type&;
+
+            const_iterator() = default;
+
+            reference operator*() const noexcept {
+                return *path[depth - 1]->key;
+            }
+
+            pointer operator->() const noexcept {
+                return path[depth - 1]->key.get();
+            }
+
+            const_iterator& operator++() noexcept {
+                const node* n = path[--depth];
+                descend(n->right.get());
+                return *this;
+            }
+
+            const_iterator operator++(int) noexcept {
+                const_iterator result(*this);
+                operator++();
+                return result;
+            }
+
+            friend bool operator==(const const_iterator& a,
+                                   const const_iterator& b) noexcept {
+                return a.depth == b.depth &&
+                       (a.depth == 0 || a.path[a.depth - 1] ==
+                                        b.path[b.depth - 1]);
+            }
+
+        private:
+            friend class persistent_stack;
+            using node = typename key_tree::node;
+
+            explicit const_iterator(const node* root) noexcept {
+                descend(root);
+            }
+
+            void descend(const node* n) noexcept {
+                for (; n; n = n->left.get()) {
+                    path[depth++] = n;
+                }
+            }
+
+            // Nodes whose keys are not yet visited, current one on top.
+            const node* path[key_tree::max_height] = {};
+            size_t depth = 0;
+        };
+
+        const_iterator cbegin() const noexcept {
+            return const_iterator(keys.get());
+        }
+
+        const_iterator cend() const noexcept {
+            return const_iterator();
+        }
+    };
+}
+
+#endif //PERSISTENT_STACK_H
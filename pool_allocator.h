@@ -0,0 +1,314 @@
+#ifndef POOL_ALLOCATOR_H
+#define POOL_ALLOCATOR_H
+
+#include <cstddef>
+#include <memory>
+#include <mutex>
+#include <new>
+
+namespace cxx {
+    namespace detail {
+        /* Node pool used by pool_allocator.
+         * Blocks of up to max_block_size bytes are grouped in size classes of
+        granularity bytes. Every thread keeps its own free lists and its own
+        bump region, so the common path takes no lock. Free blocks are moved
+        between threads in batches through a global depot.
+
+         * Memory is carved from chunks which are never returned to the system
+        (the pool only grows), so a block can be freed by any thread, also
+        after the thread which allocated it has finished. A finishing thread
+        leaves the rest of its bump region in the depot, where the next
+        thread needing one takes it before a new chunk.
+        */
+        namespace pool {
+            constexpr std::size_t granularity = 16;
+            constexpr std::size_t max_block_size = 512;
+            constexpr std::size_t class_count = max_block_size / granularity;
+            constexpr std::size_t chunk_size = 64 * 1024;
+            // Number of blocks moved at once between a thread and the depot.
+            constexpr std::size_t batch_size = 64;
+
+            struct block {
+                block* next;
+            };
+
+            // Header of a spare bump region, at its beginning.
+            struct region {
+                region* next;
+                std::byte* end;
+            };
+            static_assert(sizeof(region) <= max_block_size);
+
+            // Chunks are linked through their header to stay reachable.
+            struct alignas(granularity) chunk_header {
+                chunk_header* next;
+            };
+
+            inline std::size_t class_of(std::size_t bytes) noexcept {
+                return (bytes + granularity - 1) / granularity - 1;
+            }
+
+            inline std::size_t block_size(std::size_t c) noexcept {
+                return (c + 1) * granularity;
+            }
+
+            class depot {
+            public:
+                std::mutex mutex;
+                block* free[class_count] = {};
+                std::size_t length[class_count] = {};
+                chunk_header* chunks = nullptr;
+                region* spare = nullptr; // Left by finished threads.
+                std::size_t reserved = 0;
+
+                // Returns usable part of a new chunk, mutex must be held.
+                std::byte* new_chunk() {
+                    auto* h = static_cast<chunk_header*>(
+                            ::operator new(chunk_size));
+                    h->next = chunks;
+                    chunks = h;
+                    reserved += chunk_size;
+                    return reinterpret_cast<std::byte*>(h + 1);
+                }
+
+                // Sets [begin, end) to a spare region, or to the usable part
+                // of a new chunk if there is none, mutex must be held.
+                void new_region(std::byte*& begin, std::byte*& end) {
+                    if (spare) {
+                        region* r = spare;
+                        spare = r->next;
+                        begin = reinterpret_cast<std::byte*>(r);
+                        end = r->end;
+                        return;
+                    }
+                    begin = new_chunk();
+                    end = begin + chunk_size - sizeof(chunk_header);
+                }
+
+                // Takes [begin, end) of at least max_block_size bytes.
+                void give_region(std::byte* begin, std::byte* end) noexcept {
+                    std::lock_guard<std::mutex> lock(mutex);
+                    region* r = reinterpret_cast<region*>(begin);
+                    r->next = spare;
+                    r->end = end;
+                    spare = r;
+                }
+
+                void give(std::size_t c, block* first, block* last,
+                          std::size_t n) noexcept {
+                    std::lock_guard<std::mutex> lock(mutex);
+                    last->next = free[c];
+                    free[c] = first;
+                    length[c] += n;
+                }
+
+                // Used only by threads whose cache is already destroyed.
+                void* take_one(std::size_t c) {
+                    std::lock_guard<std::mutex> lock(mutex);
+                    if (!free[c]) {
+                        std::byte* p = new_chunk();
+                        std::byte* end = p + chunk_size - sizeof(chunk_header);
+                        for (; p + block_size(c) <= end; p += block_size(c)) {
+                            block* b = reinterpret_cast<block*>(p);
+                            b->next = free[c];
+                            free[c] = b;
+                            ++length[c];
+                        }
+                    }
+                    block* b = free[c];
+                    free[c] = b->next;
+                    --length[c];
+                    return b;
+                }
+            };
+
+            // Never destroyed, blocks may be freed during static destruction.
+            inline depot& global_depot() {
+                static depot* d = new depot();
+                return *d;
+            }
+
+            inline thread_local bool cache_gone = false;
+
+            class thread_cache {
+            public:
+                block* free[class_count] = {};
+                std::size_t length[class_count] = {};
+                std::byte* bump = nullptr;
+                std::byte* bump_end = nullptr;
+
+                ~thread_cache() {
+                    // The rest of the bump region is kept for another
+                    // thread, or as a block if no class may fill it.
+                    const auto rest = bump_end - bump;
+                    if (rest >= static_cast<std::ptrdiff_t>(max_block_size)) {
+                        global_depot().give_region(bump, bump_end);
+                    }
+                    else if (rest > 0) {
+                        push(class_of(static_cast<std::size_t>(rest)),
+                             reinterpret_cast<block*>(bump));
+                    }
+                    for (std::size_t c = 0; c < class_count; ++c) {
+                        if (free[c]) {
+                            block* last = free[c];
+                            while (last->next) {
+                                last = last->next;
+                            }
+                            global_depot().give(c, free[c], last, length[c]);
+                        }
+                    }
+                    cache_gone = true;
+                }
+
+                void refill(std::size_t c) {
+                    depot& d = global_depot();
+                    std::lock_guard<std::mutex> lock(d.mutex);
+                    for (std::size_t i = 0; i < batch_size && d.free[c]; ++i) {
+                        block* b = d.free[c];
+                        d.free[c] = b->next;
+                        --d.length[c];
+                        push(c, b);
+                    }
+                    if (free[c]) {
+                        return;
+                    }
+                    const auto size =
+                            static_cast<std::ptrdiff_t>(block_size(c));
+                    if (bump_end - bump < size) {
+                        // The rest, too small for c, is a block of a smaller
+                        // class.
+                        if (bump_end - bump > 0) {
+                            push(class_of(static_cast<std::size_t>(
+                                         bump_end - bump)),
+                                 reinterpret_cast<block*>(bump));
+                        }
+                        d.new_region(bump, bump_end);
+                    }
+                    for (std::size_t i = 0;
+                         i < batch_size && bump_end - bump >= size;
+                         ++i, bump += size) {
+                        push(c, reinterpret_cast<block*>(bump));
+                    }
+                }
+
+                void release_batch(std::size_t c) noexcept {
+                    block* first = free[c];
+                    block* last = first;
+                    for (std::size_t i = 1; i < batch_size; ++i) {
+                        last = last->next;
+                    }
+                    free[c] = last->next;
+                    length[c] -= batch_size;
+                    global_depot().give(c, first, last, batch_size);
+                }
+
+                void push(std::size_t c, block* b) noexcept {
+                    b->next = free[c];
+                    free[c] = b;
+                    ++length[c];
+                }
+            };
+
+            inline thread_local thread_cache cache;
+
+            inline bool handles(std::size_t bytes, std::size_t align) noexcept {
+                return bytes != 0 && bytes <= max_block_size &&
+                       align <= granularity;
+            }
+
+            inline void* allocate(std::size_t bytes) {
+                const std::size_t c = class_of(bytes);
+                if (cache_gone) {
+                    return global_depot().take_one(c);
+                }
+                thread_cache& tc = cache;
+                if (!tc.free[c]) {
+                    tc.refill(c);
+                }
+                block* b = tc.free[c];
+                tc.free[c] = b->next;
+                --tc.length[c];
+                return b;
+            }
+
+            inline void deallocate(void* p, std::size_t bytes) noexcept {
+                const std::size_t c = class_of(bytes);
+                block* b = static_cast<block*>(p);
+                if (cache_gone) {
+                    global_depot().give(c, b, b, 1);
+                    return;
+                }
+                thread_cache& tc = cache;
+                tc.push(c, b);
+                if (tc.length[c] > 2 * batch_size) {
+                    tc.release_batch(c);
+                }
+            }
+
+            // Bytes taken from the system by the pool so far.
+            inline std::size_t reserved_bytes() noexcept {
+                depot& d = global_depot();
+                std::lock_guard<std::mutex> lock(d.mutex);
+                return d.reserved;
+            }
+        }
+    }
+
+    /* Stateless allocator serving small blocks from the node pool.
+     * Nodes allocated by cxx::stack (list and map nodes, key control blocks,
+    the shared state) all fall into the pool, larger requests (slot chunks,
+    hash tables) are passed to std::allocator.
+    */
+    template <typename T> class pool_allocator {
+    public:
+        using value_type = T;
+
+        pool_allocator() noexcept = default;
+
+        template <typename U>
+        pool_allocator(const pool_allocator<U>&) noexcept {}
+
+        T* allocate(std::size_t n) {
+            if (pooled(n)) {
+                return static_cast<T*>(detail::pool::allocate(n * sizeof(T)));
+            }
+            return std::allocator<T>().allocate(n);
+        }
+
+        void deallocate(T* p, std::size_t n) noexcept {
+            if (pooled(n)) {
+                detail::pool::deallocate(p, n * sizeof(T));
+                return;
+            }
+            std::allocator<T>().deallocate(p, n);
+        }
+
+        // Bytes reserved by the pool shared by all pool_allocators.
+        static std::size_t reserved_bytes() noexcept {
+            return detail::pool::reserved_bytes();
+        }
+
+        // Bytes taken by an allocation of bytes with alignment align.
+        static std::size_t allocation_size(std::size_t bytes,
+                                           std::size_t align) noexcept {
+            if (detail::pool::handles(bytes, align)) {
+                return detail::pool::block_size(detail::pool::class_of(bytes));
+            }
+            return bytes;
+        }
+
+        template <typename U>
+        friend bool operator==(const pool_allocator&,
+                               const pool_allocator<U>&) noexcept {
+            return true;
+        }
+
+    private:
+        static bool pooled(std::size_t n) noexcept {
+            return n <= detail::pool::max_block_size / sizeof(T) &&
+                   detail::pool::handles(n * sizeof(T), alignof(T));
+        }
+    };
+}
+
+#endif //POOL_ALLOCATOR_H
@@ -0,0 +1,180 @@
+#ifndef SHARDED_STACK_H
+#define SHARDED_STACK_H
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <thread>
+#include <utility>
+
+#include "stack.h"
+
+namespace cxx {
+    /* Stack for many writer threads, with keys partitioned into shards.
+     * Every shard is a cxx::stack<K, ...> (with the given Options) guarded
+    by its own mutex and holds all elements of the keys hashed to it, so
+    push, pop(k), front(k) and count(k) lock one shard only and operations
+    on keys of different shards run in parallel.
+
+     * Every element gets a number from a global sequence when it is
+    pushed. pop(), front() and size() lock all shards (in order) and find
+    the top of the stack as the newest shard top, which takes O(shards).
+
+     * All values are returned by copy, since a reference would outlive
+    the lock. Exception guarantees are those of cxx::stack.
+    */
+    template <typename K, typename V, typename... Options>
+    class sharded_stack {
+    private:
+        struct element_t {
+            std::uint64_t seq;
+            V value;
+        };
+
+        using shard_stack_t = stack<K, element_t, Options...>;
+
+        // Shards are aligned to cache lines, so their locks do not share one.
+        struct alignas(64) shard_t {
+            std::mutex mutex;
+            shard_stack_t elems;
+        };
+
+        // Locks all shards for a consistent view. Strong exception guarantee.
+        class all_shards_lock {
+        public:
+            explicit all_shards_lock(shard_t* s, size_t n) : shards(s),
+                                                            locked(0) {
+                for (; locked < n; ++locked) {
+                    shards[locked].mutex.lock();
+                }
+            }
+            ~all_shards_lock() noexcept {
+                while (locked > 0) {
+                    shards[--locked].mutex.unlock();
+                }
+            }
+            all_shards_lock(const all_shards_lock&) = delete;
+            all_shards_lock& operator=(const all_shards_lock&) = delete;
+        private:
+            shard_t* shards;
+            size_t locked;
+        };
+
+        std::unique_ptr<shard_t[]> shards;
+        size_t shard_count;
+        std::atomic<std::uint64_t> next_seq;
+
+        // Mixed in 64 bits, size_t may have only 32.
+        shard_t& shard_of(const K& k) const {
+            const std::uint64_t h =
+                    static_cast<std::uint64_t>(std::hash<K>()(k)) *
+                    0x9E3779B97F4A7C15ull;
+            return shards[static_cast<size_t>((h >> 32) % shard_count)];
+        }
+
+        static std::uint64_t top_seq(const shard_t& s) {
+            return s.elems.front().second.seq;
+        }
+
+        // Shard holding the top of the stack, all shards must be locked.
+        shard_t* top_shard() const {
+            shard_t* result = nullptr;
+            for (size_t i = 0; i < shard_count; ++i) {
+                if (shards[i].elems.size() &&
+                    (!result || top_seq(shards[i]) > top_seq(*result))) {
+                    result = &shards[i];
+                }
+            }
+            return result;
+        }
+
+        template <typename KArg, typename VArg>
+        void push_impl(KArg&& k, VArg&& v) {
+            shard_t& s = shard_of(k);
+            std::lock_guard<std::mutex> lock(s.mutex);
+            const std::uint64_t seq =
+                    next_seq.fetch_add(1, std::memory_order_relaxed);
+            s.elems.push(std::forward<KArg>(k),
+                         element_t{seq, std::forward<VArg>(v)});
+        }
+
+    public:
+        // K must be hashable with std::hash<K>; shards is at least 1.
+        explicit sharded_stack(size_t shards_n = std::max(
+                1u, std::thread::hardware_concurrency()))
+                : shards(), shard_count(std::max<size_t>(shards_n, 1)),
+                  next_seq(0) {
+            shards = std::make_unique<shard_t[]>(shard_count);
+        }
+
+        sharded_stack(const sharded_stack&) = delete;
+        sharded_stack& operator=(const sharded_stack&) = delete;
+
+        void push(const K& k, const V& v) {
+            push_impl(k, v);
+        }
+
+        void push(K&& k, V&& v) {
+            push_impl(std::move(k), std::move(v));
+        }
+
+        void pop() {
+            all_shards_lock lock(shards.get(), shard_count);
+            shard_t* s = top_shard();
+            if (!s) {
+                throw std::invalid_argument("Error: Empty stack");
+            }
+            s->elems.pop();
+        }
+
+        void pop(const K& k) {
+            shard_t& s = shard_of(k);
+            std::lock_guard<std::mutex> lock(s.mutex);
+            s.elems.pop(k);
+        }
+
+        std::pair<K, V> front() const {
+            all_shards_lock lock(shards.get(), shard_count);
+            const shard_t* s = top_shard();
+            if (!s) {
+                throw std::invalid_argument("Error: empty stack");
+            }
+            auto top = s->elems.front();
+            return std::pair<K, V>(top.first, top.second.value);
+        }
+
+        V front(const K& k) const {
+            shard_t& s = shard_of(k);
+            std::lock_guard<std::mutex> lock(s.mutex);
+            return std::as_const(s.elems).front(k).value;
+        }
+
+        size_t count(const K& k) const {
+            shard_t& s = shard_of(k);
+            std::lock_guard<std::mutex> lock(s.mutex);
+            return s.elems.count(k);
+        }
+
+        size_t size() const {
+            all_shards_lock lock(shards.get(), shard_count);
+            size_t result = 0;
+            for (size_t i = 0; i < shard_count; ++i) {
+                result += shards[i].elems.size();
+            }
+            return result;
+        }
+
+        void clear() {
+            all_shards_lock lock(shards.get(), shard_count);
+            for (size_t i = 0; i < shard_count; ++i) {
+                shards[i].elems.clear();
+            }
+        }
+    };
+}
+
+#endif //SHARDED_STACK_H
@@ -1,322 +1,3122 @@
 #ifndef STACK_H
 #define STACK_H
 
+#include <algorithm>
+#include <atomic>
+#include <bit>
 #include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <limits>
 #include <list>
 #include <map>
 #include <memory>
-#include <stack>
+#include <new>
+#include <optional>
 #include <iterator>
+#include <ranges>
 #include <stdexcept>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+#include <vector>
 
 namespace cxx {
-    template <typename K, typename V> class stack {
+    // Events counted by stack if CXX_STACK_STATS is defined, with the value
+    // they add to the statistics.
+    enum class stack_event {
+        cow_copy, // Data copied on write or from an unshareable stack: elements.
+        unshareable, // Stack became unshareable by non-const front: 1.
+        rollback, // Modification undone because of an exception: 1.
+        allocation // Memory allocated by a stack: bytes.
+    };
+
+#ifdef CXX_STACK_STATS
+    /* Statistics of all stacks of the program, kept in relaxed atomics. The
+    hook, if set, is called after every event but allocation, by the thread
+    which caused it.
+    */
+    struct stack_stats {
+        size_t cow_copies;
+        size_t elements_cloned;
+        size_t bytes_allocated;
+        size_t unshareable_transitions;
+        size_t rollbacks;
+    };
+
+    using stack_stats_hook = void (*)(stack_event, size_t) noexcept;
+
+    namespace detail {
+        struct stats_counters {
+            std::atomic<size_t> cow_copies{0};
+            std::atomic<size_t> elements_cloned{0};
+            std::atomic<size_t> bytes_allocated{0};
+            std::atomic<size_t> unshareable_transitions{0};
+            std::atomic<size_t> rollbacks{0};
+            std::atomic<stack_stats_hook> hook{nullptr};
+        };
+
+        inline stats_counters global_stats;
+
+        inline void note(stack_event e, size_t value) noexcept {
+            constexpr auto relaxed = std::memory_order_relaxed;
+            switch (e) {
+                case stack_event::cow_copy:
+                    global_stats.cow_copies.fetch_add(1, relaxed);
+                    global_stats.elements_cloned.fetch_add(value, relaxed);
+                    break;
+                case stack_event::unshareable:
+                    global_stats.unshareable_transitions.fetch_add(value,
+                                                                   relaxed);
+                    break;
+                case stack_event::rollback:
+                    global_stats.rollbacks.fetch_add(value, relaxed);
+                    break;
+                case stack_event::allocation:
+                    global_stats.bytes_allocated.fetch_add(value, relaxed);
+                    return;
+            }
+            if (stack_stats_hook hook = global_stats.hook.load(relaxed)) {
+                hook(e, value);
+            }
+        }
+
+        // Allocator used by stack in place of A, counts allocated bytes.
+        template <typename A> class stats_allocator : public A {
+        private:
+            using traits = std::allocator_traits<A>;
+        public:
+            template <typename U> struct rebind {
+                using other = stats_allocator<
+                        typename traits::template rebind_alloc<U>>;
+            };
+
+            stats_allocator() = default;
+            stats_allocator(const A& a) noexcept : A(a) {}
+            template <typename B>
+            stats_allocator(const stats_allocator<B>& other) noexcept
+                    : A(static_cast<const B&>(other)) {}
+
+            typename traits::pointer allocate(size_t n) {
+                note(stack_event::allocation,
+                     n * sizeof(typename traits::value_type));
+                return traits::allocate(*this, n);
+            }
+
+            stats_allocator select_on_container_copy_construction() const {
+                return traits::select_on_container_copy_construction(*this);
+            }
+        };
+
+        template <typename A> using internal_allocator = stats_allocator<A>;
+    }
+
+    inline stack_stats get_stack_stats() noexcept {
+        const auto& g = detail::global_stats;
+        constexpr auto relaxed = std::memory_order_relaxed;
+        return stack_stats{g.cow_copies.load(relaxed),
+                           g.elements_cloned.load(relaxed),
+                           g.bytes_allocated.load(relaxed),
+                           g.unshareable_transitions.load(relaxed),
+                           g.rollbacks.load(relaxed)};
+    }
+
+    inline void reset_stack_stats() noexcept {
+        auto& g = detail::global_stats;
+        g.cow_copies = 0;
+        g.elements_cloned = 0;
+        g.bytes_allocated = 0;
+        g.unshareable_transitions = 0;
+        g.rollbacks = 0;
+    }
+
+    // Hook must be thread safe, nullptr removes it.
+    inline void set_stack_stats_hook(stack_stats_hook hook) noexcept {
+        detail::global_stats.hook = hook;
+    }
+#else
+    namespace detail {
+        // Statistics are disabled, calls compile to nothing.
+        inline void note(stack_event, size_t) noexcept {}
+
+        template <typename A> using internal_allocator = A;
+    }
+#endif
+
+    namespace detail {
+        // Base of all policy tags, any other option of stack is its allocator.
+        struct policy {};
+        struct storage_policy : policy {};
+        struct index_policy : policy {};
+        struct removal_policy : policy {};
+        struct reclamation_policy : policy {};
+
+        /* Data of a stack with deferred_reclamation whose last reference was
+        released, waiting in deferred_states for cxx::reclaim
+        (stack_reclaim.h). release destroys up to budget of its elements,
+        decreasing budget, and then the rest of it once it has none;
+        it returns whether all of it is destroyed.
+        */
+        struct reclaimable {
+            reclaimable* next = nullptr;
+            bool (*release)(reclaimable*, size_t& budget) noexcept = nullptr;
+        };
+
+        struct not_reclaimable {};
+
+        // Lock-free list of released data, consumers take all of it at once.
+        class reclaim_queue {
+        public:
+            void push(reclaimable* r) noexcept {
+                r->next = head.load(std::memory_order_relaxed);
+                while (!head.compare_exchange_weak(r->next, r,
+                                                   std::memory_order_release,
+                                                   std::memory_order_relaxed)) {
+                }
+            }
+            // The last pushed first.
+            reclaimable* take_all() noexcept {
+                return head.exchange(nullptr, std::memory_order_acquire);
+            }
+            bool empty() const noexcept {
+                return head.load(std::memory_order_relaxed) == nullptr;
+            }
+        private:
+            std::atomic<reclaimable*> head{nullptr};
+        };
+
+        inline reclaim_queue deferred_states;
+
+        // Numbers states as they are created, so a state allocated at the
+        // address of a freed one is told apart from it (push_hint).
+        inline std::atomic<std::uint64_t> state_generations{0};
+
+        // Mark of elements removed by lazy_removal, empty otherwise.
+        template <bool Lazy> struct tombstone {
+            bool dead = false;
+        };
+
+        template <> struct tombstone<false> {
+            static constexpr bool dead = false;
+        };
+
+        /* Layouts of the nodes of std::list and std::map and of the block of
+        std::allocate_shared, as in libstdc++ and libc++, used to estimate
+        memory_usage of a stack.
+        */
+        template <typename T> struct list_node_layout {
+            void* links[2];
+            T value;
+        };
+
+        template <typename T> struct tree_node_layout {
+            int color;
+            void* links[3];
+            T value;
+        };
+
+        template <typename T> struct shared_block_layout {
+            void* vtable;
+            int counts[2];
+            T value;
+        };
+
+        // Bytes taken by an allocation of bytes with A: A::allocation_size
+        // if it has one (pool_allocator), else the requested size.
+        template <typename A>
+        size_t allocation_bytes(size_t bytes, size_t align) noexcept {
+            if constexpr (requires { A::allocation_size(bytes, align); }) {
+                return A::allocation_size(bytes, align);
+            }
+            else {
+                return bytes;
+            }
+        }
+
+        template <typename A, typename T>
+        size_t allocation_bytes() noexcept {
+            return allocation_bytes<A>(sizeof(T), alignof(T));
+        }
+
+        // First option derived from Category, Default if there is none.
+        template <typename Category, typename Default, typename... Options>
+        struct select_policy {
+            using type = Default;
+        };
+
+        template <typename Category, typename Default, typename O,
+                  typename... Options>
+        struct select_policy<Category, Default, O, Options...> {
+            using type = std::conditional_t<std::is_base_of_v<Category, O>, O,
+                    typename select_policy<Category, Default,
+                                           Options...>::type>;
+        };
+
+        // First option which is not a policy, Default if there is none.
+        template <typename Default, typename... Options>
+        struct select_allocator {
+            using type = Default;
+        };
+
+        template <typename Default, typename O, typename... Options>
+        struct select_allocator<Default, O, Options...> {
+            using type = std::conditional_t<std::is_base_of_v<policy, O>,
+                    typename select_allocator<Default, Options...>::type, O>;
+        };
+
+        // main_stack kept in std::list, handles are list iterators.
+        template <typename Elem, typename Alloc> class list_store {
+        private:
+            using list_t = std::list<Elem, Alloc>;
+            list_t elems;
+        public:
+            using handle = typename list_t::iterator;
+            using const_iterator = typename list_t::const_iterator;
+
+            explicit list_store(const Alloc& a) : elems(a) {}
+            list_store(const list_store& other, const Alloc& a)
+                    : elems(other.elems, a) {}
+
+            /* Translates handles of a store to handles of its copy. Built in
+            one pass over both stores, without an allocation per element:
+            (old node, new handle) pairs in store order, and a flat table
+            of their positions, open addressed by the address of the old
+            node and at most 3/4 full. Positions take 32 bits while they
+            fit, so the table stays small enough for the cache. Lookups take
+            expected O(1).
+            */
+            class handle_map {
+            public:
+                static constexpr bool identity = false;
+
+                handle_map(const list_store& from, list_store& to)
+                        : pairs(pair_alloc(to.elems.get_allocator())),
+                          narrow(slot_alloc<std::uint32_t>(
+                                  to.elems.get_allocator())),
+                          wide(slot_alloc<size_t>(to.elems.get_allocator())) {
+                    const size_t n = from.size();
+                    const size_t capacity = std::bit_ceil(n + n / 3 + 1);
+                    shift = 64 - std::countr_zero(capacity);
+                    pairs.reserve(n);
+                    if (n < free_slot<std::uint32_t>) {
+                        narrow.assign(capacity, free_slot<std::uint32_t>);
+                    }
+                    else {
+                        wide.assign(capacity, free_slot<size_t>);
+                    }
+                    auto it = to.elems.begin();
+                    for (const Elem& e : from.elems) {
+                        if (wide.empty()) {
+                            insert(narrow, &e);
+                        }
+                        else {
+                            insert(wide, &e);
+                        }
+                        pairs.push_back(entry{&e, it++});
+                    }
+                }
+                handle operator()(handle h) const noexcept {
+                    return wide.empty() ? find(narrow, &*h) : find(wide, &*h);
+                }
+            private:
+                struct entry {
+                    const Elem* elem;
+                    handle to;
+                };
+                template <typename Pos>
+                static constexpr Pos free_slot = static_cast<Pos>(-1);
+
+                using pair_alloc = typename std::allocator_traits<Alloc>::
+                        template rebind_alloc<entry>;
+                template <typename Pos>
+                using slot_alloc = typename std::allocator_traits<Alloc>::
+                        template rebind_alloc<Pos>;
+                template <typename Pos>
+                using table = std::vector<Pos, slot_alloc<Pos>>;
+
+                // Fibonacci hashing of the address to the top bits.
+                size_t slot_of(const Elem* e) const noexcept {
+                    return static_cast<size_t>(
+                            static_cast<std::uint64_t>(
+                                    reinterpret_cast<std::uintptr_t>(e)) *
+                            0x9E3779B97F4A7C15ull >> shift);
+                }
+
+                // Takes the position of e, the next one in pairs.
+                template <typename Pos>
+                void insert(table<Pos>& slots, const Elem* e) noexcept {
+                    size_t i = slot_of(e);
+                    while (slots[i] != free_slot<Pos>) {
+                        i = (i + 1) & (slots.size() - 1);
+                    }
+                    slots[i] = static_cast<Pos>(pairs.size());
+                }
+
+                template <typename Pos>
+                handle find(const table<Pos>& slots,
+                            const Elem* e) const noexcept {
+                    size_t i = slot_of(e);
+                    while (pairs[slots[i]].elem != e) {
+                        i = (i + 1) & (slots.size() - 1);
+                    }
+                    return pairs[slots[i]].to;
+                }
+
+                std::vector<entry, pair_alloc> pairs;
+                table<std::uint32_t> narrow; // Empty if wide is used.
+                table<size_t> wide;
+                int shift = 0;
+            };
+
+            template <typename... Args>
+            void emplace_front(Args&&... args) {
+                elems.emplace_front(std::forward<Args>(args)...);
+            }
+            void pop_front() noexcept {
+                elems.pop_front();
+            }
+            void pop_back() noexcept {
+                elems.pop_back();
+            }
+            void erase(handle h) noexcept {
+                elems.erase(h);
+            }
+            // Unlinks h without destroying it, by moving its node to spare,
+            // returns the handle of the element below it (end if none).
+            handle detach(handle h, list_store& spare) noexcept {
+                const handle below = std::next(h);
+                spare.elems.splice(spare.elems.begin(), elems, h);
+                return below;
+            }
+            // Links h detached to spare back above below.
+            void attach(handle h, handle below, list_store& spare) noexcept {
+                elems.splice(below, spare.elems, h);
+            }
+            // Destroys h detached to spare.
+            void release(handle h, list_store& spare) noexcept {
+                spare.elems.erase(h);
+            }
+            // Moves all elements of other on top of this store in O(1),
+            // their handles stay valid. Allocators must be equal.
+            void splice_front(list_store& other) noexcept {
+                elems.splice(elems.begin(), other.elems);
+            }
+            // Erases all elements for which pred is true, in one pass.
+            template <typename Pred>
+            void erase_if(Pred pred) noexcept {
+                for (auto it = elems.begin(); it != elems.end();) {
+                    it = pred(*it) ? elems.erase(it) : std::next(it);
+                }
+            }
+            void clear() noexcept {
+                elems.clear();
+            }
+            // Nodes are allocated one by one, nothing to reserve.
+            void reserve(size_t) noexcept {}
+            bool has_room(size_t) const noexcept {
+                return true;
+            }
+
+            handle front_handle() noexcept {
+                return elems.begin();
+            }
+            handle back_handle() noexcept {
+                return std::prev(elems.end());
+            }
+            Elem& operator[](handle h) noexcept {
+                return *h;
+            }
+            const Elem& operator[](handle h) const noexcept {
+                return *h;
+            }
+            Elem& front() noexcept {
+                return elems.front();
+            }
+            const Elem& front() const noexcept {
+                return elems.front();
+            }
+            Elem& back() noexcept {
+                return elems.back();
+            }
+            const Elem& back() const noexcept {
+                return elems.back();
+            }
+
+            size_t size() const noexcept {
+                return elems.size();
+            }
+            bool empty() const noexcept {
+                return elems.empty();
+            }
+            // Bytes of the list nodes.
+            size_t allocated_bytes() const noexcept {
+                return elems.size() *
+                       allocation_bytes<Alloc, list_node_layout<Elem>>();
+            }
+
+            // Iteration from the top of the stack to the bottom.
+            const_iterator begin() const noexcept {
+                return elems.cbegin();
+            }
+            const_iterator end() const noexcept {
+                return elems.cend();
+            }
+        };
+
+        /* main_stack kept in a slab of slots addressed by 32-bit indices.
+         * Slots live in chunks of growing size (16, 16, 32, 64...), so they
+        are never relocated and V needs no move constructor. Elements are
+        linked in stack order by the prev/next index arrays, slots freed by
+        erase are chained through next and reused by later pushes.
+        */
+        template <typename Elem, typename Alloc> class slot_store {
+        public:
+            using handle = std::uint32_t;
+            static constexpr handle npos = std::numeric_limits<handle>::max();
+
+            class const_iterator {
+            public:
+                using iterator_category = std::bidirectional_iterator_tag;
+                using value_type = Elem;
+                using difference_type = ptrdiff_t;
+                using pointer = const Elem*;
+                using reference = const Elem&;
+
+                const_iterator() = default;
+                const_iterator(const slot_store* s, handle h) noexcept
+                        : store(s), pos(h) {}
+
+                reference operator*() const noexcept {
+                    return (*store)[pos];
+                }
+                pointer operator->() const noexcept {
+                    return &(*store)[pos];
+                }
+                const_iterator& operator++() noexcept {
+                    pos = store->next[pos];
+                    return *this;
+                }
+                const_iterator operator++(int) noexcept {
+                    const_iterator result(*this);
+                    operator++();
+                    return result;
+                }
+                const_iterator& operator--() noexcept {
+                    pos = pos == npos ? store->tail : store->prev[pos];
+                    return *this;
+                }
+                const_iterator operator--(int) noexcept {
+                    const_iterator result(*this);
+                    operator--();
+                    return result;
+                }
+                friend bool operator==(const const_iterator& a,
+                                       const const_iterator& b) noexcept {
+                    return a.pos == b.pos;
+                }
+            private:
+                const slot_store* store = nullptr;
+                handle pos = npos;
+            };
+
+            explicit slot_store(const Alloc& a)
+                    : alloc(a), prev(a), next(a) {}
+
+            // Elements are copied into slots with the same indices.
+            slot_store(const slot_store& other, const Alloc& a)
+                    : alloc(a), prev(other.prev, a), next(other.next, a),
+                      head(other.head), tail(other.tail),
+                      free_head(other.free_head), used(other.used),
+                      count(other.count) {
+                handle h = head;
+                try {
+                    for (size_t c = 0; c < max_chunks && other.chunks[c]; ++c) {
+                        chunks[c] = std::allocator_traits<Alloc>::allocate(
+                                alloc, chunk_slots(c));
+                    }
+                    for (; h != npos; h = next[h]) {
+                        std::allocator_traits<Alloc>::construct(
+                                alloc, &(*this)[h], other[h]);
+                    }
+                }
+                catch (...) {
+                    for (handle d = head; d != h; d = next[d]) {
+                        std::allocator_traits<Alloc>::destroy(alloc,
+                                                              &(*this)[d]);
+                    }
+                    release_chunks();
+                    throw;
+                }
+            }
+
+            // Handles of a copy are equal to the original ones.
+            class handle_map {
+            public:
+                static constexpr bool identity = true;
+
+                handle_map(const slot_store&, slot_store&) noexcept {}
+                handle operator()(handle h) const noexcept {
+                    return h;
+                }
+            };
+
+            slot_store(const slot_store&) = delete;
+            slot_store& operator=(const slot_store&) = delete;
+
+            ~slot_store() {
+                for (handle h = head; h != npos; h = next[h]) {
+                    std::allocator_traits<Alloc>::destroy(alloc, &(*this)[h]);
+                }
+                release_chunks();
+            }
+
+            template <typename... Args>
+            void emplace_front(Args&&... args) {
+                const handle h = free_head != npos ? free_head : new_slot();
+                std::allocator_traits<Alloc>::construct(
+                        alloc, &(*this)[h], std::forward<Args>(args)...);
+                if (h == free_head) {
+                    free_head = next[h];
+                }
+                else {
+                    ++used;
+                }
+                prev[h] = npos;
+                next[h] = head;
+                (head == npos ? tail : prev[head]) = h;
+                head = h;
+                ++count;
+            }
+            void pop_front() noexcept {
+                erase(head);
+            }
+            void pop_back() noexcept {
+                erase(tail);
+            }
+            void erase(handle h) noexcept {
+                (prev[h] == npos ? head : next[prev[h]]) = next[h];
+                (next[h] == npos ? tail : prev[next[h]]) = prev[h];
+                std::allocator_traits<Alloc>::destroy(alloc, &(*this)[h]);
+                next[h] = free_head;
+                free_head = h;
+                --count;
+            }
+            // Unlinks h without destroying it, its slot stays taken until
+            // release, returns the handle of the element below it (npos if
+            // none). spare is used by list_store only.
+            handle detach(handle h, slot_store&) noexcept {
+                const handle below = next[h];
+                (prev[h] == npos ? head : next[prev[h]]) = next[h];
+                (next[h] == npos ? tail : prev[next[h]]) = prev[h];
+                --count;
+                return below;
+            }
+            // Links detached h back above below.
+            void attach(handle h, handle below, slot_store&) noexcept {
+                const handle above = below == npos ? tail : prev[below];
+                prev[h] = above;
+                next[h] = below;
+                (above == npos ? head : next[above]) = h;
+                (below == npos ? tail : prev[below]) = h;
+                ++count;
+            }
+            // Destroys detached h and frees its slot.
+            void release(handle h, slot_store&) noexcept {
+                std::allocator_traits<Alloc>::destroy(alloc, &(*this)[h]);
+                next[h] = free_head;
+                free_head = h;
+            }
+            // Erases all elements for which pred is true, in one pass.
+            template <typename Pred>
+            void erase_if(Pred pred) noexcept {
+                for (handle h = head; h != npos;) {
+                    const handle n = next[h];
+                    if (pred((*this)[h])) {
+                        erase(h);
+                    }
+                    h = n;
+                }
+            }
+            // Destroys all elements, slots stay allocated.
+            void clear() noexcept {
+                for (handle h = head; h != npos; h = next[h]) {
+                    std::allocator_traits<Alloc>::destroy(alloc, &(*this)[h]);
+                }
+                head = tail = free_head = npos;
+                used = 0;
+                count = 0;
+            }
+            // Makes room for n elements, so pushes up to that size do not
+            // allocate. Only capacity grows when it throws.
+            void reserve(size_t n) {
+                if (has_room(n)) {
+                    return;
+                }
+                if (n > npos) {
+                    throw std::length_error("Error: stack is too large");
+                }
+                const size_t last = chunk_of(static_cast<handle>(n - 1));
+                for (size_t c = 0; c <= last; ++c) {
+                    allocate_chunk(c);
+                }
+            }
+
+            // Whether reserve(n) has nothing to allocate.
+            bool has_room(size_t n) const noexcept {
+                return n <= capacity();
+            }
+
+            handle front_handle() const noexcept {
+                return head;
+            }
+            handle back_handle() const noexcept {
+                return tail;
+            }
+            Elem& operator[](handle h) noexcept {
+                const size_t c = chunk_of(h);
+                return *std::launder(chunks[c] + (h - chunk_begin(c)));
+            }
+            const Elem& operator[](handle h) const noexcept {
+                const size_t c = chunk_of(h);
+                return *std::launder(chunks[c] + (h - chunk_begin(c)));
+            }
+            Elem& front() noexcept {
+                return (*this)[head];
+            }
+            const Elem& front() const noexcept {
+                return (*this)[head];
+            }
+            Elem& back() noexcept {
+                return (*this)[tail];
+            }
+            const Elem& back() const noexcept {
+                return (*this)[tail];
+            }
+
+            size_t size() const noexcept {
+                return count;
+            }
+            bool empty() const noexcept {
+                return count == 0;
+            }
+            // Number of allocated slots.
+            size_t capacity() const noexcept {
+                size_t c = 0;
+                while (c < max_chunks && chunks[c]) {
+                    ++c;
+                }
+                return c == 0 ? 0 : chunk_begin(c - 1) + chunk_slots(c - 1);
+            }
+            // Bytes of the chunks and of the link arrays.
+            size_t allocated_bytes() const noexcept {
+                size_t bytes = 0;
+                for (size_t c = 0; c < max_chunks && chunks[c]; ++c) {
+                    bytes += allocation_bytes<Alloc>(
+                            chunk_slots(c) * sizeof(Elem), alignof(Elem));
+                }
+                for (const index_vector* v : {&prev, &next}) {
+                    if (v->capacity() > 0) {
+                        bytes += allocation_bytes<Alloc>(
+                                v->capacity() * sizeof(handle),
+                                alignof(handle));
+                    }
+                }
+                return bytes;
+            }
+            // Capacity of a store which reserved n slots.
+            static size_t capacity_for(size_t n) noexcept {
+                if (n == 0) {
+                    return 0;
+                }
+                const size_t c = chunk_of(static_cast<handle>(n - 1));
+                return chunk_begin(c) + chunk_slots(c);
+            }
+
+            const_iterator begin() const noexcept {
+                return const_iterator(this, head);
+            }
+            const_iterator end() const noexcept {
+                return const_iterator(this, npos);
+            }
+
+        private:
+            using index_vector = std::vector<handle,
+                    typename std::allocator_traits<Alloc>::template
+                    rebind_alloc<handle>>;
+
+            static constexpr size_t first_chunk_slots = 16;
+            static constexpr size_t max_chunks =
+                    std::numeric_limits<handle>::digits - 3;
+
+            // Chunk 0 holds slots [0, 16), chunk c > 0 holds [8 * 2^c, 16 * 2^c).
+            static size_t chunk_of(handle h) noexcept {
+                return std::bit_width(h / first_chunk_slots);
+            }
+            static size_t chunk_begin(size_t c) noexcept {
+                return c == 0 ? 0 : first_chunk_slots << (c - 1);
+            }
+            static size_t chunk_slots(size_t c) noexcept {
+                return c == 0 ? first_chunk_slots : first_chunk_slots << (c - 1);
+            }
+
+            void release_chunks() noexcept {
+                for (size_t c = 0; c < max_chunks && chunks[c]; ++c) {
+                    std::allocator_traits<Alloc>::deallocate(alloc, chunks[c],
+                                                             chunk_slots(c));
+                }
+            }
+
+            // Makes sure slot number used exists. Only capacity grows when
+            // it throws, so the stack is not changed.
+            handle new_slot() {
+                if (used == npos) {
+                    throw std::length_error("Error: stack is too large");
+                }
+                allocate_chunk(chunk_of(used));
+                return used;
+            }
+
+            void allocate_chunk(size_t c) {
+                if (chunks[c]) {
+                    return;
+                }
+                const size_t capacity = chunk_begin(c) + chunk_slots(c);
+                if (next.size() < capacity) {
+                    next.resize(capacity, npos);
+                }
+                if (prev.size() < capacity) {
+                    prev.resize(capacity, npos);
+                }
+                chunks[c] = std::allocator_traits<Alloc>::allocate(
+                        alloc, chunk_slots(c));
+            }
+
+            Alloc alloc;
+            Elem* chunks[max_chunks] = {};
+            index_vector prev;
+            index_vector next; // For free slots: next free slot.
+            handle head = npos; // Top of the stack.
+            handle tail = npos; // Bottom of the stack.
+            handle free_head = npos;
+            handle used = 0; // Number of slots ever taken.
+            size_t count = 0;
+        };
+
+        // Small trivially copyable keys are held by value, in the index and
+        // in every element, a copy costs less than a shared_ptr to one.
+        template <typename K>
+        inline constexpr bool inline_key = std::is_trivially_copyable_v<K> &&
+                                           sizeof(K) <= sizeof(std::shared_ptr<K>);
+
+        template <typename K>
+        using key_holder = std::conditional_t<inline_key<K>, K,
+                                              std::shared_ptr<K>>;
+
+        // Keys are held by key_holder and looked up with plain K.
+        template <typename K> struct key_access {
+            static const K& get(const K& k) noexcept {
+                return k;
+            }
+            static const K& get(const std::shared_ptr<K>& k) noexcept {
+                return *k;
+            }
+        };
+
+        template <typename K>
+        concept ordered_key = requires(const K& a, const K& b) {
+            { a < b } -> std::convertible_to<bool>;
+        };
+
+        // Transparent comparator of keys, whichever way they are held.
+        template <typename K> struct key_less {
+            using is_transparent = void;
+
+            template <typename A, typename B>
+            bool operator()(const A& lhs, const B& rhs) const {
+                return key_access<K>::get(lhs) < key_access<K>::get(rhs);
+            }
+        };
+
+        template <typename K> struct key_hash {
+            using is_transparent = void;
+
+            template <typename A>
+            size_t operator()(const A& k) const {
+                return std::hash<K>()(key_access<K>::get(k));
+            }
+        };
+
+        template <typename K> struct key_equal {
+            using is_transparent = void;
+
+            template <typename A, typename B>
+            bool operator()(const A& lhs, const B& rhs) const {
+                return key_access<K>::get(lhs) == key_access<K>::get(rhs);
+            }
+        };
+
+        /* Open addressing hash map with linear probing, used by hashed_index.
+         * Every slot has a control byte: empty, deleted or full with 7 bits
+        of the hash, so most probes of other keys are rejected without
+        comparing keys. Erase leaves a deleted marker and never moves
+        elements, markers are dropped by the next rehash.
+
+         * Interface is the subset of std::map used by stack. Inserting may
+        rehash and invalidates all iterators, erase invalidates only
+        iterators to the erased element. Rehash gives the strong guarantee,
+        elements are moved only if that cannot throw, otherwise copied.
+        */
+        template <typename Key, typename Mapped, typename Hash, typename Eq,
+                  typename Alloc>
+        class hash_map {
+        public:
+            using value_type = std::pair<Key, Mapped>;
+            using allocator_type = typename std::allocator_traits<Alloc>::
+                    template rebind_alloc<value_type>;
+
+        private:
+            using alloc_traits = std::allocator_traits<allocator_type>;
+            using ctrl_allocator = typename alloc_traits::template
+                    rebind_alloc<std::uint8_t>;
+
+            static constexpr std::uint8_t empty_slot = 0;
+            static constexpr std::uint8_t deleted_slot = 1;
+            static constexpr std::uint8_t full_slot = 0x80;
+            static constexpr size_t min_capacity = 16;
+
+            template <bool Const> class basic_iterator {
+            public:
+                using iterator_category = std::forward_iterator_tag;
+                using value_type = hash_map::value_type;
+                using difference_type = ptrdiff_t;
+                using pointer = std::conditional_t<Const, const value_type*,
+                                                   value_type*>;
+                using reference = std::conditional_t<Const, const value_type&,
+                                                     value_type&>;
+
+                basic_iterator() = default;
+                basic_iterator(const hash_map* m, size_t i) noexcept
+                        : map(m), pos(i) {
+                    skip_free();
+                }
+                operator basic_iterator<true>() const noexcept {
+                    return basic_iterator<true>(map, pos);
+                }
+
+                reference operator*() const noexcept {
+                    return map->slots[pos];
+                }
+                pointer operator->() const noexcept {
+                    return map->slots + pos;
+                }
+                basic_iterator& operator++() noexcept {
+                    ++pos;
+                    skip_free();
+                    return *this;
+                }
+                basic_iterator operator++(int) noexcept {
+                    basic_iterator result(*this);
+                    operator++();
+                    return result;
+                }
+                friend bool operator==(const basic_iterator& a,
+                                       const basic_iterator& b) noexcept {
+                    return a.pos == b.pos;
+                }
+            private:
+                friend class hash_map;
+
+                void skip_free() noexcept {
+                    while (pos < map->capacity &&
+                           !(map->ctrl[pos] & full_slot)) {
+                        ++pos;
+                    }
+                }
+
+                const hash_map* map = nullptr;
+                size_t pos = 0;
+            };
+
+        public:
+            using iterator = basic_iterator<false>;
+            using const_iterator = basic_iterator<true>;
+
+            explicit hash_map(const allocator_type& a) : alloc(a) {}
+
+            hash_map(const hash_map&) = delete;
+            hash_map& operator=(const hash_map&) = delete;
+
+            ~hash_map() {
+                destroy(slots, ctrl, capacity);
+            }
+
+            template <typename T>
+            iterator find(const T& k) {
+                return iterator(this, find_pos(k));
+            }
+            template <typename T>
+            const_iterator find(const T& k) const {
+                return const_iterator(this, find_pos(k));
+            }
+
+            // Inserts value_type(k, m...) if k is not present yet.
+            template <typename KArg, typename... MArgs>
+            std::pair<iterator, bool> emplace(KArg&& k, MArgs&&... m) {
+                size_t pos = find_pos(k);
+                if (pos != capacity) {
+                    return {iterator(this, pos), false};
+                }
+                if ((used + 1) * 4 > capacity * 3) {
+                    rehash((count + 1) * 2 > capacity
+                           ? std::max(min_capacity, capacity * 2) : capacity);
+                }
+                const std::uint64_t h = hash(k);
+                pos = free_pos(h);
+                alloc_traits::construct(alloc, slots + pos,
+                                        std::piecewise_construct,
+                                        std::forward_as_tuple(
+                                                std::forward<KArg>(k)),
+                                        std::forward_as_tuple(
+                                                std::forward<MArgs>(m)...));
+                if (ctrl[pos] == empty_slot) {
+                    ++used;
+                }
+                ctrl[pos] = tag(h);
+                ++count;
+                return {iterator(this, pos), true};
+            }
+
+            // Hint is ignored, present for compatibility with std::map.
+            template <typename KArg, typename... MArgs>
+            iterator emplace_hint(const_iterator, KArg&& k, MArgs&&... m) {
+                return emplace(std::forward<KArg>(k),
+                               std::forward<MArgs>(m)...).first;
+            }
+
+            void erase(const_iterator it) noexcept {
+                alloc_traits::destroy(alloc, slots + it.pos);
+                ctrl[it.pos] = deleted_slot;
+                --count;
+            }
+
+            // Inserts v, whose key is not present, without rehashing, to undo
+            // an erase. The caller keeps room for it by keep_room, so some
+            // slots stay empty. Hash must not throw.
+            void restore(value_type&& v) noexcept {
+                const std::uint64_t h = hash(v.first);
+                const size_t pos = free_pos(h);
+                alloc_traits::construct(alloc, slots + pos, std::move(v));
+                if (ctrl[pos] == empty_slot) {
+                    ++used;
+                }
+                ctrl[pos] = tag(h);
+                ++count;
+            }
+
+            // Destroys all elements, the table stays allocated.
+            void clear() noexcept {
+                for (size_t i = 0; i < capacity; ++i) {
+                    if (ctrl[i] & full_slot) {
+                        alloc_traits::destroy(alloc, slots + i);
+                    }
+                }
+                std::fill(ctrl, ctrl + capacity, empty_slot);
+                count = 0;
+                used = 0;
+            }
+
+            // Makes room for n elements, inserting up to that size does not
+            // rehash and keeps iterators valid. Strong exception guarantee.
+            void reserve(size_t n) {
+                if (has_room(n)) {
+                    return;
+                }
+                rehash(bucket_count_for(n));
+            }
+            // Whether reserve(n) does not rehash.
+            bool has_room(size_t n) const noexcept {
+                return n <= count || (used + n - count) * 4 <= capacity * 3;
+            }
+
+            // Makes room for n inserts or restores on top of the taken and
+            // deleted slots, growing to twice the need when it rehashes, so
+            // that a call per insert takes amortized O(1). Strong exception
+            // guarantee.
+            void keep_room(size_t n) {
+                if ((used + n) * 4 > capacity * 3) {
+                    rehash(bucket_count_for(2 * (count + n)));
+                }
+            }
+            // keep_room(n) which keeps the iterators in [first, last) valid,
+            // they are moved to the new positions of their elements.
+            template <typename It>
+            void keep_room(size_t n, It first, It last) {
+                if ((used + n) * 4 <= capacity * 3) {
+                    return;
+                }
+                using pos_allocator = typename alloc_traits::template
+                        rebind_alloc<size_t>;
+                std::vector<size_t, pos_allocator> moved(
+                        capacity, pos_allocator(alloc));
+                rehash(bucket_count_for(2 * (count + n)), moved.data());
+                for (; first != last; ++first) {
+                    first->pos = moved[first->pos];
+                }
+            }
+
+            // Number of slots of the table.
+            size_t bucket_count() const noexcept {
+                return capacity;
+            }
+            // Smallest table which holds n elements.
+            static size_t bucket_count_for(size_t n) noexcept {
+                return n == 0 ? 0 : std::bit_ceil(
+                        std::max(min_capacity, (n * 4 + 2) / 3));
+            }
+
+            iterator begin() noexcept {
+                return iterator(this, 0);
+            }
+            iterator end() noexcept {
+                return iterator(this, capacity);
+            }
+            const_iterator begin() const noexcept {
+                return const_iterator(this, 0);
+            }
+            const_iterator end() const noexcept {
+                return const_iterator(this, capacity);
+            }
+            const_iterator cbegin() const noexcept {
+                return begin();
+            }
+            const_iterator cend() const noexcept {
+                return end();
+            }
+
+            size_t size() const noexcept {
+                return count;
+            }
+            bool empty() const noexcept {
+                return count == 0;
+            }
+            allocator_type get_allocator() const noexcept {
+                return alloc;
+            }
+            // Bytes of the slots and of the control bytes.
+            size_t allocated_bytes() const noexcept {
+                if (capacity == 0) {
+                    return 0;
+                }
+                return allocation_bytes<allocator_type>(
+                               capacity * sizeof(value_type),
+                               alignof(value_type)) +
+                       allocation_bytes<allocator_type>(capacity, 1);
+            }
+
+        private:
+            // Fibonacci hashing, spreads std::hash of integers (identity).
+            // The low bits of the product depend only on the low bits of
+            // the key, so the slot is taken from the top bits and the tag
+            // from the upper half below them.
+            template <typename T>
+            std::uint64_t hash(const T& k) const {
+                return static_cast<std::uint64_t>(Hash()(k)) *
+                       0x9E3779B97F4A7C15ull;
+            }
+            static std::uint8_t tag(std::uint64_t h) noexcept {
+                return full_slot | static_cast<std::uint8_t>((h >> 32) & 0x7F);
+            }
+            size_t home(std::uint64_t h) const noexcept {
+                return static_cast<size_t>(
+                        h >> (64 - std::countr_zero(capacity)));
+            }
+
+            // Position of k, capacity if it is not present.
+            template <typename T>
+            size_t find_pos(const T& k) const {
+                if (count == 0) {
+                    return capacity;
+                }
+                const std::uint64_t h = hash(k);
+                for (size_t pos = home(h);; pos = (pos + 1) & (capacity - 1)) {
+                    if (ctrl[pos] == tag(h) && Eq()(slots[pos].first, k)) {
+                        return pos;
+                    }
+                    if (ctrl[pos] == empty_slot) {
+                        return capacity;
+                    }
+                }
+            }
+
+            size_t free_pos(std::uint64_t h) const noexcept {
+                size_t pos = home(h);
+                while (ctrl[pos] & full_slot) {
+                    pos = (pos + 1) & (capacity - 1);
+                }
+                return pos;
+            }
+
+            void destroy(value_type* s, std::uint8_t* c, size_t cap) noexcept {
+                if (!cap) {
+                    return;
+                }
+                for (size_t i = 0; i < cap; ++i) {
+                    if (c[i] & full_slot) {
+                        alloc_traits::destroy(alloc, s + i);
+                    }
+                }
+                alloc_traits::deallocate(alloc, s, cap);
+                ctrl_allocator ca(alloc);
+                std::allocator_traits<ctrl_allocator>::deallocate(ca, c, cap);
+            }
+
+            // Sets moved[i] to the new position of the element at i, for
+            // each full slot i, if moved is not null.
+            void rehash(size_t new_capacity, size_t* moved = nullptr) {
+                // Hash may throw, so all of them are computed before any
+                // element is moved.
+                using hash_allocator = typename alloc_traits::template
+                        rebind_alloc<std::uint64_t>;
+                std::vector<std::uint64_t, hash_allocator> hashes{
+                        hash_allocator(alloc)};
+                hashes.reserve(count);
+                for (size_t i = 0; i < capacity; ++i) {
+                    if (ctrl[i] & full_slot) {
+                        hashes.push_back(hash(slots[i].first));
+                    }
+                }
+
+                ctrl_allocator ca(alloc);
+                auto* new_ctrl = std::allocator_traits<ctrl_allocator>::
+                        allocate(ca, new_capacity);
+                std::fill(new_ctrl, new_ctrl + new_capacity, empty_slot);
+                value_type* new_slots;
+                try {
+                    new_slots = alloc_traits::allocate(alloc, new_capacity);
+                }
+                catch (...) {
+                    std::allocator_traits<ctrl_allocator>::deallocate(
+                            ca, new_ctrl, new_capacity);
+                    throw;
+                }
+
+                std::swap(slots, new_slots);
+                std::swap(ctrl, new_ctrl);
+                std::swap(capacity, new_capacity);
+                try {
+                    auto h_it = hashes.cbegin();
+                    for (size_t i = 0; i < new_capacity; ++i) {
+                        if (new_ctrl[i] & full_slot) {
+                            const std::uint64_t h = *h_it++;
+                            const size_t pos = free_pos(h);
+                            alloc_traits::construct(
+                                    alloc, slots + pos,
+                                    std::move_if_noexcept(new_slots[i]));
+                            ctrl[pos] = tag(h);
+                            if (moved) {
+                                moved[i] = pos;
+                            }
+                        }
+                    }
+                }
+                catch (...) {
+                    std::swap(slots, new_slots);
+                    std::swap(ctrl, new_ctrl);
+                    std::swap(capacity, new_capacity);
+                    destroy(new_slots, new_ctrl, new_capacity);
+                    throw;
+                }
+                destroy(new_slots, new_ctrl, new_capacity);
+                used = count;
+            }
+
+            allocator_type alloc;
+            value_type* slots = nullptr;
+            std::uint8_t* ctrl = nullptr;
+            size_t capacity = 0;
+            size_t count = 0; // Full slots.
+            size_t used = 0; // Full and deleted slots.
+        };
+    }
+
+    // main_stack kept in std::list (default).
+    struct list_storage : detail::storage_policy {
+        template <typename Elem, typename Alloc>
+        using store = detail::list_store<Elem, Alloc>;
+    };
+
+    // main_stack kept in a contiguous slab of slots, per-key stacks hold
+    // 32-bit slot indices. Removing from the middle leaves a hole which is
+    // reused by the next push.
+    struct slot_storage : detail::storage_policy {
+        template <typename Elem, typename Alloc>
+        using store = detail::slot_store<Elem, Alloc>;
+    };
+
+    // Keys indexed by std::map (default), keys are iterated in increasing order.
+    struct ordered_index : detail::index_policy {
+        template <typename K, typename Key, typename Mapped, typename Alloc>
+        using map = std::map<Key, Mapped, detail::key_less<K>,
+                typename std::allocator_traits<Alloc>::template
+                rebind_alloc<std::pair<const Key, Mapped>>>;
+
+        // Whether looking up a key cannot throw.
+        template <typename K>
+        static constexpr bool nothrow_lookup =
+                noexcept(bool(std::declval<const K&>() <
+                              std::declval<const K&>()));
+
+        /* Chain of k in m and true, or the position to insert k at and
+        false, in one descent of the tree. If hint is the entry of k or of
+        the greatest key below k (or of the key before that), it takes O(1)
+        comparisons instead of O(log n).
+        */
+        template <typename Map, typename K>
+        static std::pair<typename Map::iterator, bool> locate(
+                Map& m, typename Map::const_iterator hint, const K& k) {
+            const auto less = m.key_comp();
+            const auto h = m.erase(hint, hint); // Same position, not const.
+            if (h != m.end() && !less(k, h->first)) {
+                if (!less(h->first, k)) {
+                    return {h, true};
+                }
+                const auto next = std::next(h);
+                if (next == m.end() || less(k, next->first)) {
+                    return {next, false};
+                }
+                if (!less(next->first, k)) {
+                    return {next, true};
+                }
+            }
+            const auto it = m.lower_bound(k);
+            return {it, it != m.end() && !less(k, it->first)};
+        }
+
+        // Entry erased by extract, which restore puts back without
+        // allocating.
+        template <typename Map>
+        using extracted = typename Map::node_type;
+
+        template <typename Map>
+        static extracted<Map> extract(Map& m,
+                                      typename Map::iterator it) noexcept {
+            return m.extract(it);
+        }
+
+        // With a comparison which cannot throw.
+        template <typename Map>
+        static void restore(Map& m, extracted<Map>&& e) noexcept {
+            m.insert(std::move(e));
+        }
+
+        // Bytes of the tree nodes.
+        template <typename Map>
+        static size_t allocated_bytes(const Map& m) noexcept {
+            return m.size() * detail::allocation_bytes<
+                    typename Map::allocator_type,
+                    detail::tree_node_layout<typename Map::value_type>>();
+        }
+    };
+
+    /* Keys indexed by an open addressing hash table, K must be hashable with
+    std::hash<K> and comparable with ==. Compared to ordered_index:
+     * push, pop, pop(K const &), front(K const &) and count take expected
+    O(1) instead of O(log n), push which inserts a new key may rehash in O(k)
+    (k distinct keys, amortized O(1)).
+     * cbegin/cend iterate keys in unspecified order, each key once. The
+    order may change after any push of a new key.
+     * Pushing a new key invalidates key iterators, removing a key
+    invalidates only iterators to that key.
+     * All operations keep the strong exception guarantee.
+    */
+    struct hashed_index : detail::index_policy {
+        template <typename K, typename Key, typename Mapped, typename Alloc>
+        using map = detail::hash_map<Key, Mapped, detail::key_hash<K>,
+                                     detail::key_equal<K>, Alloc>;
+
+        template <typename K>
+        static constexpr bool nothrow_lookup =
+                noexcept(std::hash<K>()(std::declval<const K&>())) &&
+                noexcept(bool(std::declval<const K&>() ==
+                              std::declval<const K&>()));
+
+        // Chain of k and true, or end() and false. Lookups take expected
+        // O(1) already, the hint is ignored.
+        template <typename Map, typename K>
+        static std::pair<typename Map::iterator, bool> locate(
+                Map& m, typename Map::const_iterator, const K& k) {
+            const auto it = m.find(k);
+            return {it, it != m.end()};
+        }
+
+        // Entry erased by extract, which restore puts back without
+        // rehashing if the map kept room for it (keep_room).
+        template <typename Map>
+        using extracted = typename Map::value_type;
+
+        template <typename Map>
+        static extracted<Map> extract(Map& m,
+                                      typename Map::iterator it) noexcept {
+            extracted<Map> e(std::move(*it));
+            m.erase(it);
+            return e;
+        }
+
+        // With a hash which cannot throw.
+        template <typename Map>
+        static void restore(Map& m, extracted<Map>&& e) noexcept {
+            m.restore(std::move(e));
+        }
+
+        template <typename Map>
+        static size_t allocated_bytes(const Map& m) noexcept {
+            return m.allocated_bytes();
+        }
+    };
+
+    // pop(K const &) erases the element at once (default).
+    struct eager_removal : detail::removal_policy {
+        static constexpr bool lazy = false;
+    };
+
+    /* pop(K const &) of an element below the top only unlinks it from the
+    chain of its key and marks it dead, so it takes O(1) plus the lookup
+    and does not touch its neighbours in main_stack.
+     * Dead elements are erased together, in one pass over main_stack,
+    once they are more than MaxDeadPercent of it, which takes amortized
+    O(100 / MaxDeadPercent) per pop(K const &). Their values are destroyed
+    only then (or by shrink_to_fit, clear and pop of elements above them).
+     * pop(), front() and all lookups behave as with eager_removal, the top
+    of main_stack is never dead, copies carry the dead elements along.
+    */
+    template <unsigned MaxDeadPercent = 25>
+    struct lazy_removal : detail::removal_policy {
+        static_assert(MaxDeadPercent > 0 && MaxDeadPercent < 100);
+        static constexpr bool lazy = true;
+        static constexpr size_t max_dead_percent = MaxDeadPercent;
+    };
+
+    // Data is destroyed when its last reference is released (default).
+    struct immediate_reclamation : detail::reclamation_policy {
+        static constexpr bool deferred = false;
+    };
+
+    /* Data whose last reference is released, by clear(), destruction,
+    assignment or copy on write of the last stack holding it, is only put
+    on a lock-free list in O(1). It is destroyed later by cxx::reclaim(budget)
+    or cxx::background_reclaimer (stack_reclaim.h), in the thread which
+    calls them, so K, V and the allocator must allow that. Data not
+    reclaimed before the program exits is never destroyed.
+    */
+    struct deferred_reclamation : detail::reclamation_policy {
+        static constexpr bool deferred = true;
+    };
+
+    /* Bytes of the internal structures of a stack, by stack::memory_usage().
+    Shared bytes are also used by other stacks (copy on write) and counted
+    by each of them, exclusive ones are freed with the stack.
+    */
+    struct stack_memory_usage {
+        struct part {
+            size_t exclusive = 0;
+            size_t shared = 0;
+
+            size_t total() const noexcept {
+                return exclusive + shared;
+            }
+        };
+
+        part elements; // main_stack: list nodes or slot chunks, with values.
+        part index; // Tree nodes or hash table of keys.
+        part keys; // Keys held by shared_ptr, none if they are inline.
+        part state; // Block holding main_stack and index, control block.
+
+        size_t exclusive() const noexcept {
+            return elements.exclusive + index.exclusive + keys.exclusive +
+                   state.exclusive;
+        }
+        size_t shared() const noexcept {
+            return elements.shared + index.shared + keys.shared + state.shared;
+        }
+        size_t total() const noexcept {
+            return exclusive() + shared();
+        }
+    };
+
+    // Selects clear() which keeps the storage of a stack for reuse.
+    struct keep_capacity_t {
+        explicit keep_capacity_t() = default;
+    };
+    inline constexpr keep_capacity_t keep_capacity{};
+
+    namespace detail {
+        // Snapshots of stacks (stack_snapshot.h), which use their data.
+        struct snapshot_access;
+    }
+
+    // Made by stack::freeze(), defined in frozen_stack.h.
+    template <typename K, typename V> class frozen_stack;
+
+    /* Options may contain an allocator (std::allocator<std::pair<const K, V>>
+    by default), a storage policy (list_storage by default), an index
+    policy (ordered_index by default), a removal policy (eager_removal by
+    default) and a reclamation policy (immediate_reclamation by default), in
+    any order.
+    */
+    template <typename K, typename V, typename... Options>
+    class stack {
+    public:
+        using allocator_type = typename detail::select_allocator<
+                std::allocator<std::pair<const K, V>>, Options...>::type;
+
+        // Size limit of a stack which has none (the default).
+        static constexpr size_t no_size_limit =
+                std::numeric_limits<size_t>::max();
+
     private:
+        // allocator_type, wrapped to count allocations with CXX_STACK_STATS.
+        using Alloc = detail::internal_allocator<allocator_type>;
+        using storage_policy = typename detail::select_policy<
+                detail::storage_policy, list_storage, Options...>::type;
+        using index_policy = typename detail::select_policy<
+                detail::index_policy, ordered_index, Options...>::type;
+        using removal_policy = typename detail::select_policy<
+                detail::removal_policy, eager_removal, Options...>::type;
+        using reclamation_policy = typename detail::select_policy<
+                detail::reclamation_policy, immediate_reclamation,
+                Options...>::type;
+
         template <typename P>
         using shared_ptr = std::shared_ptr<P>;
 
-        // Comparator to compare keys under shared_ptr<K>
-        struct KComp {
-            bool operator()(const shared_ptr<K>& lhs,
-                            const shared_ptr<K>& rhs) const {
-                return *lhs < *rhs;
-            }
-        };
+        // Every internal allocation is done with Alloc rebound to its type.
+        template <typename T>
+        using rebind_alloc =
+                typename std::allocator_traits<Alloc>::template rebind_alloc<T>;
 
         /* Data structure:
-         * main_stack: List containing stack content in proper order. 
-         * stacks_map: Map of stacks, every key is assigned to the stack of 
-        elements (in proper order) with that key. Elements in stacks are iterators
-        to that element's position in main_stack
+         * main_stack: Store (std::list by default) containing stack content
+        in proper order. 
+         * stacks_map: Map (std::map by default), every key is assigned to
+        the chain of elements with that key: handles (list iterators or slot
+        indices) of the newest and the oldest one in main_stack and their
+        count. Every element of main_stack keeps the handle of the previous
+        element with the same key, so a chain takes no memory apart from the
+        map entry. The oldest handle lets splice_on_top link a chain on top
+        of another in O(1); eviction by the size limit removes oldest
+        elements without finding the new oldest one, it marks bottoms stale
+        and they are found by walking the chain when needed
+
+         * There is only 1 copy of each key on the heap, we access them by
+        shared_ptr<K>, all values are kept in main_stack. Small trivially
+        copyable keys are held by value instead (detail::inline_key)
 
-         * There is only 1 copy of each key on the heap, we access them by 
-        shared_ptr<K>, all values are kept in main_stack
+         * Both structures are kept in one state_t, so sharing the stack
+        takes a single control block and reference count
+
+         * All of the above are allocated with alloc
         */
-        using main_stack_t = std::list<std::pair<shared_ptr<K>, V>>;
-        using key_stack_t = std::stack<typename main_stack_t::iterator>;
-        using stacks_map_t = std::map<shared_ptr<K>, key_stack_t, KComp>;
+        using key_holder_t = detail::key_holder<K>;
+
+        struct main_stack_elem_t;
+        using main_stack_t = typename storage_policy::template store<
+                main_stack_elem_t, rebind_alloc<main_stack_elem_t>>;
+        using handle_t = typename main_stack_t::handle;
+
+        struct main_stack_elem_t {
+            key_holder_t key;
+            V value;
+            handle_t below; // Previous element with key, unspecified if none.
+            [[no_unique_address]] detail::tombstone<removal_policy::lazy> mark;
+
+            template <typename... VArgs>
+            main_stack_elem_t(const key_holder_t& k, const handle_t& b,
+                              VArgs&&... v)
+                    : key(k), value(std::forward<VArgs>(v)...), below(b) {}
+
+            // Used only by copies of list_storage, whose links are set by
+            // state_t. The oldest element of a chain which lost elements to
+            // the size limit links to a removed one, a list iterator then
+            // must not be copied.
+            main_stack_elem_t(const main_stack_elem_t& other)
+                    : key(other.key), value(other.value),
+                      below(main_stack_t::handle_map::identity ? other.below
+                                                               : handle_t()),
+                      mark(other.mark) {}
+        };
+
+        struct key_chain_t {
+            handle_t top;
+            size_t count;
+            // Oldest element with key, removed only with the last one. With
+            // state_t::stale_bottoms it is only some element of the chain.
+            handle_t bottom;
+
+            // Removes the newest element, next is the one below it.
+            void pop_top(const handle_t& next) noexcept {
+                if (bottom == top) {
+                    bottom = next;
+                }
+                top = next;
+                --count;
+            }
+
+            // Removes the oldest element. The new oldest one is not known,
+            // bottom is kept on an element of the chain.
+            void pop_bottom() noexcept {
+                --count;
+                bottom = top;
+            }
+        };
+
+        using stacks_map_t = typename index_policy::template map<
+                K, key_holder_t, key_chain_t, Alloc>;
+
+        // Base of state_t, with deferred_reclamation it keeps the allocator
+        // to free the state with.
+        struct reclaim_hook_t : detail::reclaimable {
+            Alloc alloc;
+            explicit reclaim_hook_t(const Alloc& a) : alloc(a) {}
+        };
+
+        struct no_reclaim_hook_t : detail::not_reclaimable {
+            explicit no_reclaim_hook_t(const Alloc&) noexcept {}
+        };
+
+        using reclaim_hook = std::conditional_t<reclamation_policy::deferred,
+                                                reclaim_hook_t,
+                                                no_reclaim_hook_t>;
+
+        struct state_t : reclaim_hook {
+            main_stack_t main_stack;
+            stacks_map_t stacks_map;
+            size_t dead = 0; // Elements of main_stack marked by lazy_removal.
+            // Whether chains may have lost their oldest elements to the size
+            // limit, bottom handles are then unspecified.
+            bool stale_bottoms = false;
+            // Chain of the last pushed key, the default hint of push.
+            typename stacks_map_t::iterator last_push = stacks_map.end();
+            const std::uint64_t generation =
+                    detail::state_generations.fetch_add(
+                            1, std::memory_order_relaxed);
+
+            explicit state_t(const Alloc& a)
+                    : reclaim_hook(a),
+                      main_stack(rebind_alloc<main_stack_elem_t>(a)),
+                      stacks_map(typename stacks_map_t::allocator_type(a)) {}
+
+            // Copy in O(n): main_stack is copied in one pass, chains are
+            // translated by handle_map. Keys are shared with other (or
+            // copied, if held inline).
+            state_t(const state_t& other, const Alloc& a)
+                    : reclaim_hook(a),
+                      main_stack(other.main_stack,
+                                 rebind_alloc<main_stack_elem_t>(a)),
+                      stacks_map(typename stacks_map_t::allocator_type(a)),
+                      dead(other.dead), stale_bottoms(other.stale_bottoms) {
+                using handle_map = typename main_stack_t::handle_map;
+                handle_map remap(other.main_stack, main_stack);
+                // A hashed index is sized once instead of growing per key.
+                reserve(0, other.stacks_map.size());
+                for (const auto& [key, chain] : other.stacks_map) {
+                    const handle_t top = remap(chain.top);
+                    stacks_map.emplace_hint(
+                            stacks_map.end(), key,
+                            key_chain_t{top, chain.count,
+                                        chain.bottom == chain.top
+                                        ? top : remap(chain.bottom)});
+                    if constexpr (!handle_map::identity) {
+                        // h walks the chain in other, copy its copy.
+                        handle_t h = chain.top, copy = top;
+                        for (size_t i = 1; i < chain.count; ++i) {
+                            h = other.main_stack[h].below;
+                            const handle_t below = remap(h);
+                            main_stack[copy].below = below;
+                            copy = below;
+                        }
+                    }
+                }
+            }
+
+            // Only slot_storage and hashed_index allocate ahead, other
+            // stores and indexes allocate per node and ignore it.
+            void reserve(size_t n_elements, size_t n_keys) {
+                main_stack.reserve(n_elements);
+                if constexpr (requires { stacks_map.reserve(n_keys); }) {
+                    stacks_map.reserve(n_keys);
+                }
+            }
+            // Whether reserve(n_elements, n_keys) has nothing to do, also
+            // in a copy of the state if copy. Copies of slot stores keep
+            // their chunks, copies of hash tables are sized for their keys.
+            bool has_room(size_t n_elements, size_t n_keys,
+                          bool copy) const noexcept {
+                bool room = main_stack.has_room(n_elements);
+                if constexpr (requires { stacks_map.has_room(n_keys); }) {
+                    room = room && (copy ? n_keys <= stacks_map.size()
+                                         : stacks_map.has_room(n_keys));
+                }
+                return room;
+            }
+
+            void erase_chain(typename stacks_map_t::iterator it) noexcept {
+                if (it == last_push) {
+                    last_push = stacks_map.end();
+                }
+                stacks_map.erase(it);
+            }
+
+            // Erases all dead elements in O(n), they are in no chain.
+            void purge() noexcept {
+                if (dead > 0) {
+                    main_stack.erase_if([](const main_stack_elem_t& e) {
+                        return e.mark.dead;
+                    });
+                    dead = 0;
+                }
+            }
+
+            // Removes dead elements from the top, so that the top is live.
+            void drop_dead_top() noexcept {
+                if constexpr (removal_policy::lazy) {
+                    while (!main_stack.empty() &&
+                           main_stack.front().mark.dead) {
+                        main_stack.pop_front();
+                        --dead;
+                    }
+                }
+            }
 
-        shared_ptr<main_stack_t> main_stack;
-        shared_ptr<stacks_map_t> stacks_map;
+            // Removes dead elements from the bottom, so that the bottom is live.
+            void drop_dead_bottom() noexcept {
+                if constexpr (removal_policy::lazy) {
+                    while (!main_stack.empty() &&
+                           main_stack.back().mark.dead) {
+                        main_stack.pop_back();
+                        --dead;
+                    }
+                }
+            }
+
+            // Oldest element of chain, found by walking it in O(count) if
+            // bottoms are stale.
+            handle_t bottom_of(const key_chain_t& chain) const noexcept {
+                if (!stale_bottoms) {
+                    return chain.bottom;
+                }
+                handle_t h = chain.top;
+                for (size_t i = 1; i < chain.count; ++i) {
+                    h = main_stack[h].below;
+                }
+                return h;
+            }
+
+            // Whether storage of a state built for this size would be smaller.
+            bool has_slack() const noexcept {
+                bool slack = false;
+                if constexpr (requires { main_stack.capacity(); }) {
+                    slack = main_stack.capacity() >
+                            main_stack_t::capacity_for(main_stack.size());
+                }
+                if constexpr (requires { stacks_map.bucket_count(); }) {
+                    slack = slack || stacks_map.bucket_count() >
+                            stacks_map_t::bucket_count_for(stacks_map.size());
+                }
+                return slack;
+            }
+        };
+
+        shared_ptr<state_t> state;
         bool shareable; // Whether stack can share data with other stack (copy on write).
+        Alloc alloc;
+        size_t limit = no_size_limit; // Size above which push evicts the bottom.
+
+        static const K& key_of(const key_holder_t& k) noexcept {
+            return detail::key_access<K>::get(k);
+        }
+
+        template <typename KArg>
+        key_holder_t make_key(KArg&& k) const {
+            if constexpr (detail::inline_key<K>) {
+                return K(std::forward<KArg>(k));
+            }
+            else {
+                return std::allocate_shared<K>(alloc, std::forward<KArg>(k));
+            }
+        }
+
+        using state_traits = std::allocator_traits<rebind_alloc<state_t>>;
+
+        // State made from args. With deferred_reclamation it is allocated
+        // apart from its control block, whose deleter defers destruction.
+        template <typename... Args>
+        shared_ptr<state_t> new_state(Args&&... args) const {
+            if constexpr (reclamation_policy::deferred) {
+                rebind_alloc<state_t> a(alloc);
+                state_t* s = state_traits::allocate(a, 1);
+                try {
+                    state_traits::construct(a, s, std::forward<Args>(args)...);
+                }
+                catch (...) {
+                    state_traits::deallocate(a, s, 1);
+                    throw;
+                }
+                s->release = &release_state;
+                // The deleter is called if the control block cannot be
+                // allocated.
+                return shared_ptr<state_t>(s, [](state_t* p) noexcept {
+                    detail::deferred_states.push(p);
+                }, alloc);
+            }
+            else {
+                return std::allocate_shared<state_t>(
+                        alloc, std::forward<Args>(args)...);
+            }
+        }
+
+        // detail::reclaimable::release of states, elements are destroyed
+        // from the top, the index at once after them.
+        static bool release_state(detail::reclaimable* r,
+                                  size_t& budget) noexcept {
+            state_t* s = static_cast<state_t*>(r);
+            while (budget > 0 && !s->main_stack.empty()) {
+                s->main_stack.pop_front();
+                --budget;
+            }
+            if (!s->main_stack.empty()) {
+                return false;
+            }
+            budget -= std::min(budget, s->stacks_map.size());
+            rebind_alloc<state_t> a(s->alloc);
+            state_traits::destroy(a, s);
+            state_traits::deallocate(a, s, 1);
+            return true;
+        }
+
+        shared_ptr<state_t> make_state() const {
+            return new_state(alloc);
+        }
+
+        shared_ptr<state_t> clone_state(const state_t& other) const {
+            detail::note(stack_event::cow_copy, other.main_stack.size());
+            return new_state(other, alloc);
+        }
+
+        // Copy on write without rollback, for modifications which can fail
+        // only before changing anything: the stack then holds an equal
+        // copy of its data, which is not observable.
+        void unshare_state() {
+            if (!state.use_count()) {
+                state = make_state();
+            }
+            else if (state.use_count() > 1) {
+                state = clone_state(*state);
+            }
+        }
+
+        // Copy of state in storage reserved for exactly its size. Elements
+        // are pushed again from the bottom, so they get new handles, with a
+        // lookup of the key of each: O(n log k) with ordered_index (k
+        // distinct keys), expected O(n) with hashed_index.
+        shared_ptr<state_t> compact_state() const {
+            shared_ptr<state_t> result = make_state();
+            main_stack_t& ms = result->main_stack;
+            stacks_map_t& sm = result->stacks_map;
+            result->reserve(state->main_stack.size() - state->dead,
+                            state->stacks_map.size());
+            for (auto elem = state->main_stack.end();
+                 elem != state->main_stack.begin();) {
+                --elem;
+                if (elem->mark.dead) {
+                    continue;
+                }
+                auto chain = sm.find(elem->key);
+                const bool new_key = chain == sm.end();
+                ms.emplace_front(elem->key,
+                                 new_key ? handle_t() : chain->second.top,
+                                 elem->value);
+                if (new_key) {
+                    sm.emplace(elem->key, key_chain_t{ms.front_handle(), 1,
+                                                      ms.front_handle()});
+                }
+                else {
+                    chain->second.top = ms.front_handle();
+                    ++chain->second.count;
+                }
+            }
+            return result;
+        }
 
         // Makes a copy of Stack before modification (Copy on write). Strong exception guarantee.
         class about_to_modify {
         public:
             explicit about_to_modify(stack& s, bool mark_shareable) : st(s),
-                                                                      old_main_stack(s.main_stack), old_stacks_map(s.stacks_map),
+                                                                      old_state(s.state),
                                                                       old_shareable(s.shareable), roll_back(false) {
-                if (!s.main_stack.use_count()) {
-                    s.main_stack = std::make_shared<main_stack_t>();
-                    s.stacks_map = std::make_shared<stacks_map_t>();
+                if (!s.state.use_count()) {
+                    s.state = s.make_state();
                 }
-                else if (s.main_stack.use_count() > 2) {
-                    stack<K, V> new_stack;
-                    new_stack.copy(s);
-                    s.swap(new_stack);
+                else if (s.state.use_count() > 2) {
+                    s.state = s.clone_state(*s.state);
                 }
                 s.shareable = mark_shareable;
                 roll_back = true;
             }
             ~about_to_modify() noexcept {
                 if (roll_back) {
-                    st.main_stack = old_main_stack;
-                    st.stacks_map = old_stacks_map;
+                    st.state = old_state;
                     st.shareable = old_shareable;
+                    detail::note(stack_event::rollback, 1);
                 }
             }
             void drop_roll_back() noexcept {
                 roll_back = false;
+                if (old_shareable && !st.shareable) {
+                    detail::note(stack_event::unshareable, 1);
+                }
+            }
+            // Whether the stack got a new state, rolling back then only
+            // restores the old one.
+            bool copied() const noexcept {
+                return st.state != old_state;
             }
         private:
             stack& st;
-            std::shared_ptr<main_stack_t> old_main_stack;
-            std::shared_ptr<stacks_map_t> old_stacks_map;
+            std::shared_ptr<state_t> old_state;
             bool old_shareable;
             bool roll_back;
         };
 
-        // Pushes new element to main_stack. Strong exception guarantee.
+        // Pushes new element to main_stack, value is constructed in place
+        // from given arguments. Strong exception guarantee.
         class main_stack_guard {
         public:
-            explicit main_stack_guard(shared_ptr<main_stack_t>& ms,
-                                      const shared_ptr<K>& k, const V& v)
+            template <typename... VArgs>
+            explicit main_stack_guard(main_stack_t& ms, const key_holder_t& k,
+                                      const handle_t& below, VArgs&&... v)
                     : main_stack(ms), roll_back(false) {
-                main_stack->push_front({k, v});
+                main_stack.emplace_front(k, below, std::forward<VArgs>(v)...);
                 roll_back = true;
             }
             ~main_stack_guard() noexcept {
                 if (roll_back) {
-                    main_stack->pop_front();
+                    main_stack.pop_front();
                 }
             };
             void drop_roll_back() noexcept {
                 roll_back = false;
             }
         private:
-            shared_ptr<main_stack_t>& main_stack;
+            main_stack_t& main_stack;
             bool roll_back;
         };
 
         // Inserts new key to stack_map. Strong exception guarantee.
         class stackmap_key_guard {
         public:
-            explicit stackmap_key_guard(shared_ptr<stacks_map_t>& sm,
-                                        const shared_ptr<K>& k)
+            explicit stackmap_key_guard(stacks_map_t& sm,
+                                        typename stacks_map_t::iterator pos,
+                                        const key_holder_t& k,
+                                        const handle_t& h)
                     : stacks_map(sm), roll_back(false) {
-                it = stacks_map->insert({k, {}}).first;
+                it = stacks_map.emplace_hint(pos, k, key_chain_t{h, 1, h});
                 roll_back = true;
             }
             ~stackmap_key_guard() noexcept {
                 if (roll_back) {
-                    stacks_map->erase(it);
+                    stacks_map.erase(it);
                 }
             }
             void drop_roll_back() noexcept {
                 roll_back = false;
             }
-            typename stacks_map_t ::iterator get_iter() noexcept {
+            typename stacks_map_t::iterator get_iter() const noexcept {
                 return it;
             }
         private:
-            shared_ptr<stacks_map_t>& stacks_map;
+            stacks_map_t& stacks_map;
             typename stacks_map_t::iterator it;
             bool roll_back;
         };
 
-        // Pushes new element to stack_map.
-        class stackmap_push_guard {
-        public:
-            explicit stackmap_push_guard(key_stack_t& st,
-                                         const main_stack_t::iterator& v)
-                    : stack(st), roll_back(false) {
-                stack.push(v);
-                roll_back = true;
+        friend struct detail::snapshot_access;
+
+        void swap(stack& other) noexcept {
+            std::swap(state, other.state);
+            std::swap(shareable, other.shareable);
+            std::swap(alloc, other.alloc);
+            std::swap(limit, other.limit);
+        }
+
+        using chain_iter_t = typename stacks_map_t::iterator;
+        using chain_citer_t = typename stacks_map_t::const_iterator;
+
+        // Calls fn(value), commits the modification if it returns.
+        template <typename Fn>
+        static auto call_and_commit(about_to_modify& modification, Fn&& fn,
+                                    V& value) {
+            if constexpr (std::is_void_v<std::invoke_result_t<Fn, V&>>) {
+                std::invoke(std::forward<Fn>(fn), value);
+                modification.drop_roll_back();
             }
-            ~stackmap_push_guard() noexcept {
-                if (roll_back) {
-                    stack.pop();
+            else {
+                auto result = std::invoke(std::forward<Fn>(fn), value);
+                modification.drop_roll_back();
+                return result;
+            }
+        }
+
+        /* With lookups and construction of values which cannot throw, push
+        fails only in an allocation, each of which leaves the stack as it
+        was. It then needs no guards: the copy on write is done by
+        unshare_state and the only step to undo is the push of an element
+        whose key could not be inserted.
+        */
+        template <typename... VArgs>
+        static constexpr bool lean_push =
+                index_policy::template nothrow_lookup<K> &&
+                std::is_nothrow_constructible_v<V, VArgs...>;
+
+        // Pushes to a state which is not shared, returns the chain of k,
+        // which becomes the last pushed one. hint is passed to the index
+        // (index_policy::locate). Key is either const K& or K&&, value is
+        // constructed in place from v. Strong exception guarantee,
+        // arguments passed as rvalues may be left moved-from on exception.
+        template <typename KArg, typename... VArgs>
+        chain_iter_t push_unshared(chain_citer_t hint, KArg&& k,
+                                   VArgs&&... v) {
+            const auto [pos, found] = index_policy::locate(
+                    state->stacks_map, hint, std::as_const(k));
+            chain_iter_t result;
+            if constexpr (lean_push<VArgs...>) {
+                main_stack_t& ms = state->main_stack;
+                if (found) {
+                    key_chain_t& chain = pos->second;
+                    ms.emplace_front(pos->first, chain.top,
+                                     std::forward<VArgs>(v)...);
+                    chain.top = ms.front_handle();
+                    ++chain.count;
+                    result = pos;
+                }
+                else {
+                    key_holder_t key = make_key(std::forward<KArg>(k));
+                    ms.emplace_front(key, handle_t(),
+                                     std::forward<VArgs>(v)...);
+                    try {
+                        result = state->stacks_map.emplace_hint(
+                                pos, std::move(key),
+                                key_chain_t{ms.front_handle(), 1,
+                                            ms.front_handle()});
+                    }
+                    catch (...) {
+                        ms.pop_front();
+                        detail::note(stack_event::rollback, 1);
+                        throw;
+                    }
                 }
             }
-            void drop_roll_back() noexcept {
-                roll_back = false;
+            else {
+                result = push_guarded(pos, found, std::forward<KArg>(k),
+                                      std::forward<VArgs>(v)...);
             }
-        private:
-            key_stack_t & stack;
-            bool roll_back;
-        };
+            state->last_push = result;
+            return result;
+        }
 
-        void swap(stack& other) noexcept {
-            std::swap(stacks_map, other.stacks_map);
-            std::swap(main_stack, other.main_stack);
-            std::swap(shareable, other.shareable);
+        // push_unshared for other types, every step is undone by a guard.
+        template <typename KArg, typename... VArgs>
+        chain_iter_t push_guarded(chain_iter_t pos, bool found, KArg&& k,
+                                  VArgs&&... v) {
+            // Key is allocated only if it is not present on the stack yet.
+            key_holder_t temp_key = found ? pos->first
+                                          : make_key(std::forward<KArg>(k));
+
+            main_stack_guard push_main_stack(
+                    state->main_stack, temp_key,
+                    found ? pos->second.top : handle_t(),
+                    std::forward<VArgs>(v)...);
+            const handle_t it = state->main_stack.front_handle();
+
+            if (!found) {
+                stackmap_key_guard push_new_key(state->stacks_map, pos,
+                                                temp_key, it);
+                push_new_key.drop_roll_back();
+                pos = push_new_key.get_iter();
+            }
+            else {
+                pos->second.top = it;
+                ++pos->second.count;
+            }
+
+            push_main_stack.drop_roll_back();
+            return pos;
+        }
+
+        /* Common part of push, push_hint and emplace, returns the chain of
+        k. hint is used if it belongs to the state of hint_generation at
+        hint_owner and that is still the state pushed to (its data was not
+        copied on write), otherwise the chain of the last pushed key is.
+        */
+        template <typename KArg, typename... VArgs>
+        chain_iter_t push_impl(const state_t* hint_owner,
+                               std::uint64_t hint_generation,
+                               chain_citer_t hint, KArg&& k, VArgs&&... v) {
+            if constexpr (lean_push<VArgs...>) {
+                unshare_state();
+                const chain_iter_t result = push_unshared(
+                        hint_owner == state.get() &&
+                        hint_generation == state->generation
+                        ? hint : state->last_push,
+                        std::forward<KArg>(k), std::forward<VArgs>(v)...);
+                if (size() > limit) {
+                    evict(1);
+                }
+                shareable = true;
+                return result;
+            }
+            else {
+                about_to_modify make_stack_copy(*this, true);
+                const chain_iter_t result = push_unshared(
+                        hint_owner == state.get() &&
+                        hint_generation == state->generation
+                        ? hint : state->last_push,
+                        std::forward<KArg>(k), std::forward<VArgs>(v)...);
+                if (size() > limit) {
+                    try {
+                        evict(1);
+                    }
+                    catch (...) {
+                        if (!make_stack_copy.copied()) {
+                            pop_top(result);
+                        }
+                        throw;
+                    }
+                }
+                make_stack_copy.drop_roll_back();
+                return result;
+            }
+        }
+
+        /* Pushes n elements by calling push_all(push_one), where
+        push_one(k, v) pushes to the unshared state. Copy on write is checked
+        once and storage reserved up front, for n_keys new keys in the index
+        (more are given room as they come). Strong exception guarantee for
+        the whole batch: if any element throws, all pushed ones are removed.
+        The size limit is applied once the whole batch is pushed.
+        */
+        template <typename PushAll>
+        void push_batch(size_t n, size_t n_keys, PushAll&& push_all) {
+            about_to_modify make_stack_copy(*this, true);
+            std::vector<chain_iter_t, rebind_alloc<chain_iter_t>> pushed(
+                    alloc);
+            pushed.reserve(n);
+            state->reserve(state->main_stack.size() + n,
+                           state->stacks_map.size() + n_keys);
+
+            try {
+                push_all([this, &pushed](auto&& k, auto&& v) {
+                    // Rollback needs chains of the pushed keys, which are
+                    // moved along if the index rehashes.
+                    stacks_map_t& sm = state->stacks_map;
+                    if constexpr (requires {
+                        sm.keep_room(1, pushed.begin(), pushed.end());
+                    }) {
+                        sm.keep_room(1, pushed.begin(), pushed.end());
+                    }
+                    pushed.push_back(push_unshared(
+                            state->last_push, std::forward<decltype(k)>(k),
+                            std::forward<decltype(v)>(v)));
+                });
+                if (size() > limit) {
+                    evict(size() - limit);
+                }
+            }
+            catch (...) {
+                if (!make_stack_copy.copied()) {
+                    while (!pushed.empty()) {
+                        pop_top(pushed.back());
+                        pushed.pop_back();
+                    }
+                }
+                throw;
+            }
+            make_stack_copy.drop_roll_back();
+        }
+
+        /* splice_on_top for stacks which do not share data, state may be
+        null. New keys are inserted to the index first (and erased again if
+        that throws), the rest cannot fail: chains of keys in both stacks
+        are joined at the bottom of the chain of other and main_stack of
+        other is spliced on top.
+         * Keys held by shared_ptr are kept once: elements of other with a
+        key already in this stack are pointed to its key, in O(count) for
+        the chain of that key. Dead elements of other, in no chain, are
+        erased first.
+        */
+        void splice_unshared(stack& other) {
+            unshare_state();
+            state_t& to = *state;
+            state_t& from = *other.state;
+            if constexpr (!detail::inline_key<K>) {
+                from.purge();
+            }
+            to.reserve(0, to.stacks_map.size() + from.stacks_map.size());
+
+            using link_t = std::pair<chain_iter_t, const key_chain_t*>;
+            std::vector<link_t, rebind_alloc<link_t>> links(alloc);
+            std::vector<chain_iter_t, rebind_alloc<chain_iter_t>> added(
+                    alloc);
+            links.reserve(from.stacks_map.size());
+            added.reserve(from.stacks_map.size());
+            try {
+                // Keys of other come in index order, so with ordered_index
+                // the previous key is a hint for the next one.
+                chain_citer_t hint = to.stacks_map.end();
+                for (const auto& [key, chain] : from.stacks_map) {
+                    const auto [pos, found] = index_policy::locate(
+                            to.stacks_map, hint, key_of(key));
+                    if (found) {
+                        links.emplace_back(pos, &chain);
+                        hint = pos;
+                    }
+                    else {
+                        added.push_back(
+                                to.stacks_map.emplace_hint(pos, key, chain));
+                        hint = added.back();
+                    }
+                }
+            }
+            catch (...) {
+                for (const chain_iter_t& it : added) {
+                    to.stacks_map.erase(it);
+                }
+                throw;
+            }
+
+            for (const auto& [pos, chain] : links) {
+                if constexpr (!detail::inline_key<K>) {
+                    handle_t h = chain->top;
+                    for (size_t i = 1;; ++i) {
+                        from.main_stack[h].key = pos->first;
+                        if (i == chain->count) {
+                            break;
+                        }
+                        h = from.main_stack[h].below;
+                    }
+                }
+                from.main_stack[from.bottom_of(*chain)].below = pos->second.top;
+                pos->second.top = chain->top;
+                pos->second.count += chain->count;
+            }
+            to.main_stack.splice_front(from.main_stack);
+            to.dead += from.dead;
+            to.stale_bottoms = to.stale_bottoms || from.stale_bottoms;
+            // References to values of other now point into this stack.
+            shareable = shareable && other.shareable;
+            other.clear();
+            if (size() > limit) {
+                evict(size() - limit);
+            }
+        }
+
+        // Removes the top element, k_chain is the chain of its key.
+        void pop_top(chain_iter_t k_chain) noexcept {
+            const main_stack_elem_t& top = state->main_stack.front();
+            if (k_chain->second.count == 1) {
+                state->erase_chain(k_chain);
+            }
+            else {
+                k_chain->second.pop_top(top.below);
+            }
+            state->main_stack.pop_front();
+        }
+
+        // Removes the bottom element, which must be live, k_chain is the
+        // chain of its key. It is the oldest element with that key, so the
+        // chain only gets shorter: below of its new oldest element is left
+        // pointing to the removed one and is never read.
+        void pop_bottom(chain_iter_t k_chain) noexcept {
+            if (k_chain->second.count == 1) {
+                state->erase_chain(k_chain);
+            }
+            else {
+                k_chain->second.pop_bottom();
+                state->stale_bottoms = true;
+            }
+            state->main_stack.pop_back();
+        }
+
+        // Removes (or marks dead) all elements of chain, which is then to be
+        // erased, and returns their count. Dead elements are dropped from
+        // the top and erased if there are too many by finish_removal.
+        size_t remove_chain(const key_chain_t& chain) noexcept {
+            main_stack_t& ms = state->main_stack;
+            handle_t h = chain.top;
+            for (size_t i = 0; i < chain.count; ++i) {
+                const handle_t below = ms[h].below;
+                if constexpr (removal_policy::lazy) {
+                    ms[h].mark.dead = true;
+                    ++state->dead;
+                }
+                else {
+                    ms.erase(h);
+                }
+                h = below;
+            }
+            return chain.count;
+        }
+
+        void finish_removal() noexcept {
+            if constexpr (removal_policy::lazy) {
+                state->drop_dead_top();
+                if (state->dead * 100 > removal_policy::max_dead_percent *
+                                        state->main_stack.size()) {
+                    state->purge();
+                }
+            }
         }
 
-        void copy(const stack& other) {
-            if (other.main_stack.use_count()) {
-                for (auto rit = other.main_stack->crbegin();
-                     rit != other.main_stack->crend(); ++rit) {
-                    push(*rit->first, rit->second);
+        // Removes n live elements from the bottom, for the size limit, in
+        // O(n log n) (expected O(n) with hashed_index). Lookups of their keys
+        // are done before anything is removed, so if one throws the stack is
+        // unchanged apart from dead elements dropped from the bottom.
+        void evict(size_t n) {
+            if (n == 1 || index_policy::template nothrow_lookup<K>) {
+                for (; n > 0; --n) {
+                    state->drop_dead_bottom();
+                    pop_bottom(state->stacks_map.find(
+                            state->main_stack.back().key));
+                }
+                return;
+            }
+            std::vector<chain_iter_t, rebind_alloc<chain_iter_t>> chains(
+                    alloc);
+            chains.reserve(n);
+            for (auto elem = state->main_stack.end(); chains.size() < n;) {
+                --elem;
+                if (!elem->mark.dead) {
+                    chains.push_back(state->stacks_map.find(elem->key));
                 }
             }
+            for (const chain_iter_t& k_chain : chains) {
+                state->drop_dead_bottom();
+                pop_bottom(k_chain);
+            }
         }
 
+        // Key held by dead elements of lazy_removal, with their number.
+        struct dead_key_count {
+            const K* key;
+            size_t count;
+            size_t uses; // use_count of the key.
+            bool in_index;
+        };
+
+        struct dead_key_less {
+            bool operator()(const dead_key_count& a, const K* b) const noexcept {
+                return std::less<const K*>()(a.key, b);
+            }
+            bool operator()(const dead_key_count& a,
+                            const dead_key_count& b) const noexcept {
+                return std::less<const K*>()(a.key, b.key);
+            }
+        };
+
+        using dead_key_counts =
+                std::vector<dead_key_count, rebind_alloc<dead_key_count>>;
+
+        /* Fills result with the keys of dead elements, sorted by address,
+        for memory_usage. O(n + dead log dead). If that runs out of memory,
+        result is left empty: keys of the index held by dead elements then
+        count as shared, keys held only by them are not counted.
+        */
+        void count_dead_keys(dead_key_counts& result) const noexcept {
+            if (state->dead == 0) {
+                return;
+            }
+            try {
+                result.reserve(state->dead);
+                for (const main_stack_elem_t& e : state->main_stack) {
+                    if (e.mark.dead) {
+                        result.push_back(dead_key_count{
+                                e.key.get(), 1,
+                                static_cast<size_t>(e.key.use_count()),
+                                false});
+                    }
+                }
+            }
+            catch (...) {
+                result.clear();
+                return;
+            }
+            std::sort(result.begin(), result.end(), dead_key_less());
+            size_t n = 0;
+            for (const dead_key_count& d : result) {
+                if (n > 0 && result[n - 1].key == d.key) {
+                    ++result[n - 1].count;
+                }
+                else {
+                    result[n++] = d;
+                }
+            }
+            result.erase(result.begin() + static_cast<std::ptrdiff_t>(n),
+                         result.end());
+        }
 
     public:
-        stack() : main_stack(), stacks_map() , shareable(true) {
-            main_stack = std::make_shared<main_stack_t>();
-            stacks_map = std::make_shared<stacks_map_t>();
+        stack() : stack(allocator_type()) {}
+
+        explicit stack(const allocator_type& a) : state(), shareable(true),
+                                                  alloc(a) {
+            state = make_state();
+        }
+
+        stack(const stack& other) : state(), shareable(true),
+                alloc(std::allocator_traits<Alloc>::
+                      select_on_container_copy_construction(other.alloc)),
+                limit(other.limit) {
+            if (other.shareable) {
+                state = other.state;
+            }
+            else if (other.state.use_count()) {
+                state = clone_state(*other.state);
+            }
+            else {
+                state = make_state();
+            }
+        }
+
+        stack(stack&& other) noexcept : state(std::move(other.state)),
+        shareable(std::move(other.shareable)), alloc(std::move(other.alloc)),
+        limit(other.limit) {}
+
+        stack& operator=(stack other) noexcept {
+            swap(other);
+            return *this;
+        }
+
+        // The chain of the last pushed key is the hint of the index, so
+        // pushes of the same key or of increasing keys take O(1) lookups
+        // with ordered_index.
+        void push(const K& k, const V& v) {
+            push_impl(nullptr, 0, chain_citer_t(), k, v);
+        }
+
+        void push(K&& k, V&& v) {
+            push_impl(nullptr, 0, chain_citer_t(), std::move(k), std::move(v));
+        }
+
+        // Constructs key and value in place from the given argument tuples,
+        // like std::map::emplace with std::piecewise_construct.
+        template <typename... KArgs, typename... VArgs>
+        void emplace(std::piecewise_construct_t,
+                     std::tuple<KArgs...> key_args,
+                     std::tuple<VArgs...> value_args) {
+            K key = std::make_from_tuple<K>(std::move(key_args));
+            std::apply([this, &key](auto&&... v) {
+                push_impl(nullptr, 0, chain_citer_t(), std::move(key),
+                          std::forward<decltype(v)>(v)...);
+            }, std::move(value_args));
+        }
+
+        void pop() {
+            if (!state.use_count() || state->main_stack.empty()) {
+                throw std::invalid_argument("Error: Empty stack");
+            }
+
+            if constexpr (index_policy::template nothrow_lookup<K>) {
+                // Only the copy on write can fail.
+                unshare_state();
+                pop_top(state->stacks_map.find(state->main_stack.front().key));
+                state->drop_dead_top();
+                shareable = true;
+            }
+            else {
+                about_to_modify make_stack_copy(*this, true);
+                pop_top(state->stacks_map.find(
+                        state->main_stack.front().key));
+                state->drop_dead_top();
+                make_stack_copy.drop_roll_back();
+            }
+        }
+
+        // Removes n elements from the top. Lookups of their keys are done
+        // before anything is removed, so the whole batch either succeeds
+        // or leaves the stack unchanged.
+        void pop_n(size_t n) {
+            if (n > size()) {
+                throw std::invalid_argument(
+                        "Error: stack has fewer than n elements");
+            }
+            if (n == 0) {
+                return;
+            }
+            if (n == size()) {
+                clear();
+                return;
+            }
+
+            about_to_modify make_stack_copy(*this, true);
+            std::vector<chain_iter_t, rebind_alloc<chain_iter_t>> chains(
+                    alloc);
+            chains.reserve(n);
+            for (auto elem = state->main_stack.begin(); chains.size() < n;
+                 ++elem) {
+                if (!elem->mark.dead) {
+                    chains.push_back(state->stacks_map.find(elem->key));
+                }
+            }
+            for (const chain_iter_t& k_chain : chains) {
+                pop_top(k_chain);
+                state->drop_dead_top();
+            }
+            make_stack_copy.drop_roll_back();
         }
 
-        stack(const stack& other) : main_stack(), stacks_map(), shareable(true) {
-            if (other.shareable) {
-                main_stack = other.main_stack;
-                stacks_map = other.stacks_map;
+        /* Pushes elements of [first, last) in order, so *(last - 1) ends on
+        top. Elements are pairs (or tuples) of key and value, moved from when
+        dereferencing gives rvalues (std::move_iterator).
+         * Copy on write is checked once, with forward iterators storage for
+        the whole batch is reserved up front. Strong exception guarantee for
+        the whole batch: if any element throws, all pushed ones are removed.
+        */
+        template <typename InputIt>
+        void push_range(InputIt first, InputIt last) {
+            using category =
+                    typename std::iterator_traits<InputIt>::iterator_category;
+            if constexpr (!std::is_base_of_v<std::forward_iterator_tag,
+                                             category>) {
+                // Rollback needs room for the chains of the whole batch,
+                // which is reserved only if the batch size is known.
+                using value_t =
+                        typename std::iterator_traits<InputIt>::value_type;
+                std::vector<value_t, rebind_alloc<value_t>> batch(first, last,
+                                                                  alloc);
+                push_range(std::make_move_iterator(batch.begin()),
+                           std::make_move_iterator(batch.end()));
             }
             else {
-                main_stack = std::make_shared<main_stack_t>();
-                stacks_map = std::make_shared<stacks_map_t>();
-                copy(other);
+                const auto n = static_cast<size_t>(std::distance(first, last));
+                if (n == 0) {
+                    return;
+                }
+
+                // Distinct keys are not known, so the index grows as new
+                // ones come instead of reserving for n of them.
+                push_batch(n, 0, [&first, &last](auto&& push_one) {
+                    for (; first != last; ++first) {
+                        auto&& e = *first;
+                        push_one(std::get<0>(std::forward<decltype(e)>(e)),
+                                 std::get<1>(std::forward<decltype(e)>(e)));
+                    }
+                });
             }
         }
 
-        stack(stack&& other) noexcept : main_stack(std::move(other.main_stack)),
-                stacks_map(std::move(other.stacks_map)),
-        shareable(std::move(other.shareable)) {}
-
-        stack& operator=(stack other) noexcept {
-            swap(other);
-            return *this;
+        /* Puts all elements of other on top of this stack, in their order,
+        and leaves other empty.
+         * With list_storage, if neither stack shares its data and their
+        allocators are equal, the nodes of other are moved by splice: no
+        element is copied, references to them stay valid and it takes one
+        lookup in this stack per distinct key of other, all done before
+        anything is moved (and O(n) walks of the chains of other if it had
+        elements evicted by its size limit). Keys held by shared_ptr also
+        take O(count) for each key present in both stacks, whose elements
+        of other are pointed to the key of this stack, and O(n) if other
+        has dead elements of lazy_removal. Otherwise the elements of other
+        are copied by push, from the bottom.
+         * Strong exception guarantee for both stacks.
+        */
+        void splice_on_top(stack&& other) {
+            if (&other == this) {
+                throw std::invalid_argument(
+                        "Error: cannot splice a stack on itself");
+            }
+            if (other.size() == 0) {
+                other.clear();
+                return;
+            }
+            if constexpr (requires(main_stack_t& a) { a.splice_front(a); }) {
+                // Eviction after the splice could not be undone, so it must
+                // not throw.
+                if (state.use_count() <= 1 &&
+                    other.state.use_count() == 1 && alloc == other.alloc &&
+                    (index_policy::template nothrow_lookup<K> ||
+                     size() + other.size() <= limit)) {
+                    splice_unshared(other);
+                    return;
+                }
+            }
+            const state_t& from = *other.state;
+            push_batch(other.size(), from.stacks_map.size(),
+                       [&from](auto&& push_one) {
+                for (auto elem = from.main_stack.end();
+                     elem != from.main_stack.begin();) {
+                    --elem;
+                    if (!elem->mark.dead) {
+                        push_one(key_of(elem->key), elem->value);
+                    }
+                }
+            });
+            other.clear();
         }
 
-        void push(const K& k, const V& v) {
+        void pop(const K& k) {
             about_to_modify make_stack_copy(*this, true);
-            shared_ptr<K> temp_key = std::make_shared<K>(k);
-            auto key_in_stack = stacks_map->find(temp_key);
-            if (key_in_stack != stacks_map->end()) {
-                temp_key = key_in_stack->first;
-            }
+            auto key_in_stack = state->stacks_map.find(k);
 
-            main_stack_guard push_main_stack(main_stack, temp_key, v);
-            auto it = main_stack->begin();
+            if (key_in_stack == state->stacks_map.end()) {
+                throw std::invalid_argument(
+                        "Error: Element with key k does not exist");
+            }
 
-            if (key_in_stack == stacks_map->end()) {
-                stackmap_key_guard push_new_key(stacks_map, temp_key);
-                stackmap_push_guard push_value(push_new_key.get_iter()->second,
-                                               it);
-                push_value.drop_roll_back();
-                push_new_key.drop_roll_back();
+            key_chain_t& chain = key_in_stack->second;
+            const handle_t top = chain.top;
+            if (chain.count == 1) {
+                state->erase_chain(key_in_stack);
             }
             else {
-                stackmap_push_guard push_value(key_in_stack->second, it);
-                push_value.drop_roll_back();
+                chain.pop_top(state->main_stack[top].below);
+            }
+            if constexpr (removal_policy::lazy) {
+                main_stack_t& ms = state->main_stack;
+                if (top == ms.front_handle()) {
+                    ms.pop_front();
+                    state->drop_dead_top();
+                }
+                else {
+                    ms[top].mark.dead = true;
+                    ++state->dead;
+                    if (state->dead * 100 >
+                        removal_policy::max_dead_percent * ms.size()) {
+                        state->purge();
+                    }
+                }
+            }
+            else {
+                state->main_stack.erase(top);
             }
-
-            push_main_stack.drop_roll_back();
             make_stack_copy.drop_roll_back();
         }
 
-        void pop() {
-            if (!main_stack.use_count() || main_stack->empty()) {
-                throw std::invalid_argument("Error: Empty stack");
+        // Removes all elements with key k after one lookup (two if the data
+        // is shared), in O(count(k)), returns their number (0 if there are
+        // none, then shared data is not copied).
+        size_t erase_key(const K& k) {
+            if (!state.use_count()) {
+                return 0;
+            }
+            chain_iter_t it = state->stacks_map.find(k);
+            if (it == state->stacks_map.end()) {
+                return 0;
             }
-
             about_to_modify make_stack_copy(*this, true);
-            auto main_stack_top = main_stack->begin();
-            auto k_stack = stacks_map->find(main_stack_top->first);
-            k_stack->second.pop();
-            if (k_stack->second.size() == 0) {
-                stacks_map->erase(k_stack);
+            if (make_stack_copy.copied()) {
+                it = state->stacks_map.find(k);
             }
-            main_stack->pop_front();
+            const size_t n = remove_chain(it->second);
+            state->erase_chain(it);
+            finish_removal();
             make_stack_copy.drop_roll_back();
+            return n;
         }
 
-        void pop(const K& k) {
-            about_to_modify make_stack_copy(*this, true);
-            shared_ptr<K> temp_key = std::make_shared<K>(k);
-            auto key_in_stack = stacks_map->find(temp_key);
-
-            if (key_in_stack == stacks_map->end() ||
-                key_in_stack->second.size() == 0) {
-                throw std::invalid_argument(
-                        "Error: Element with key k does not exist");
+        // Number of elements with keys in [lo, hi), in O(log n) plus
+        // O(1) per key in the range. Only with ordered_index.
+        size_t count_range(const K& lo, const K& hi) const
+                requires std::is_same_v<index_policy, ordered_index> {
+            if (!state.use_count() || !(lo < hi)) {
+                return 0;
+            }
+            size_t n = 0;
+            const auto last = state->stacks_map.lower_bound(hi);
+            for (auto it = state->stacks_map.lower_bound(lo); it != last;
+                 ++it) {
+                n += it->second.count;
             }
+            return n;
+        }
 
-            main_stack->erase(key_in_stack->second.top());
-            key_in_stack->second.pop();
-            if (key_in_stack->second.size() == 0) {
-                stacks_map->erase(key_in_stack);
+        // Removes all elements with keys in [lo, hi), in O(log n) plus
+        // O(count) per key in the range, returns their number. Only with
+        // ordered_index. Strong exception guarantee, the lookups are done
+        // before anything is removed. Shared data is copied only if there
+        // is something to remove.
+        size_t erase_range(const K& lo, const K& hi)
+                requires std::is_same_v<index_policy, ordered_index> {
+            if (!state.use_count() || !(lo < hi)) {
+                return 0;
+            }
+            chain_iter_t first = state->stacks_map.lower_bound(lo);
+            chain_iter_t last = state->stacks_map.lower_bound(hi);
+            if (first == last) {
+                return 0;
             }
+            about_to_modify make_stack_copy(*this, true);
+            stacks_map_t& sm = state->stacks_map;
+            if (make_stack_copy.copied()) {
+                first = sm.lower_bound(lo);
+                last = sm.lower_bound(hi);
+            }
+            size_t n = 0;
+            for (auto it = first; it != last; ++it) {
+                n += remove_chain(it->second);
+            }
+            sm.erase(first, last);
+            state->last_push = sm.end();
+            finish_removal();
             make_stack_copy.drop_roll_back();
+            return n;
         }
 
         std::pair<const K&, const V&> front() const {
-            if (!main_stack.use_count() || main_stack->empty()) {
+            if (!state.use_count() || state->main_stack.empty()) {
                 throw std::invalid_argument("Error: empty stack");
             }
-            return std::pair<const K&, const V&>(*(main_stack->front().first),
-                                                 main_stack->front().second);
+            return std::pair<const K&, const V&>(key_of(state->main_stack.front().key),
+                                                 state->main_stack.front().value);
         }
 
         std::pair<const K&, V&> front() {
-            if (!main_stack.use_count() || main_stack->empty()) {
+            if (!state.use_count() || state->main_stack.empty()) {
                 throw std::invalid_argument("Error: empty stack");
             }
             about_to_modify make_stack_copy(*this, false);
             make_stack_copy.drop_roll_back();
-            return std::pair<const K&, V&>(*(main_stack->front().first),
-                                           main_stack->front().second);
+            return std::pair<const K&, V&>(key_of(state->main_stack.front().key),
+                                           state->main_stack.front().value);
         }
 
         V& front(const K& k) {
             about_to_modify make_stack_copy(*this, false);
-            auto key = stacks_map->find(std::make_shared<K>(k));
-            if (key == stacks_map->end() || key->second.size() == 0) {
+            auto key = state->stacks_map.find(k);
+            if (key == state->stacks_map.end()) {
                 throw std::invalid_argument(
                         "Error: stack does not contain given key");
             }
             make_stack_copy.drop_roll_back();
-            return key->second.top()->second;
+            return state->main_stack[key->second.top].value;
+        }
+
+        /* Calls fn(V&) with the value on top of the stack and returns its
+        result by value. Unlike non-const front, the stack stays shareable:
+        shared data is copied first and the reference lives only for the
+        call, so fn must not keep it nor access the stack.
+         * If fn throws, the stack is unchanged, or, if its data was not
+        shared, has the value as fn left it.
+        */
+        template <typename Fn>
+        auto modify_front(Fn&& fn) {
+            if (!state.use_count() || state->main_stack.empty()) {
+                throw std::invalid_argument("Error: empty stack");
+            }
+            about_to_modify make_stack_copy(*this, shareable);
+            return call_and_commit(make_stack_copy, std::forward<Fn>(fn),
+                                   state->main_stack.front().value);
+        }
+
+        // Like modify_front for the newest value with key k. The key is
+        // looked up first, shared data is not copied if it is absent.
+        template <typename Fn>
+        auto modify(const K& k, Fn&& fn) {
+            if (!state.use_count()) {
+                throw std::invalid_argument(
+                        "Error: stack does not contain given key");
+            }
+            auto key = state->stacks_map.find(k);
+            if (key == state->stacks_map.end()) {
+                throw std::invalid_argument(
+                        "Error: stack does not contain given key");
+            }
+            about_to_modify make_stack_copy(*this, shareable);
+            if (make_stack_copy.copied()) {
+                key = state->stacks_map.find(k);
+            }
+            return call_and_commit(make_stack_copy, std::forward<Fn>(fn),
+                                   state->main_stack[key->second.top].value);
         }
 
         const V& front(const K& k) const {
-            if (!main_stack.use_count()) {
+            if (!state.use_count()) {
                 throw std::invalid_argument(
                         "Error: stack does not contain given key");
             }
-            auto key = stacks_map->find(std::make_shared<K>(k));
-            if (key == stacks_map->end() || key->second.size() == 0) {
+            auto key = state->stacks_map.find(k);
+            if (key == state->stacks_map.end()) {
                 throw std::invalid_argument(
                         "Error: stack does not contain given key");
             }
-            return key->second.top()->second;
+            return state->main_stack[key->second.top].value;
+        }
+
+        allocator_type get_allocator() const noexcept {
+            return allocator_type(alloc);
         }
 
         size_t size() const noexcept {
-            if (!main_stack.use_count()) {
+            if (!state.use_count()) {
                 return 0;
             }
-            return main_stack->size();
+            return state->main_stack.size() - state->dead;
         }
 
         size_t count(const K& k) const  {
-            if (!main_stack.use_count()) {
+            if (!state.use_count()) {
                 return 0;
             }
-            auto it = stacks_map->find(std::make_shared<K>(k));
-            if (it == stacks_map->end()) {
+            auto it = state->stacks_map.find(k);
+            if (it == state->stacks_map.end()) {
                 return 0;
             }
-            return it->second.size();
+            return it->second.count;
+        };
+
+        /* Bounded mode, for history buffers: with a size limit n, a push
+        which makes the stack larger than n evicts its bottom element (the
+        oldest one) once the new one is in place, with one lookup of its key:
+        O(log n), expected O(1) with hashed_index. Storage of evicted
+        elements is freed or reused, references to them are invalidated.
+         * push_range and splice_on_top push the whole batch first and then
+        evict from the bottom, so they may evict their own elements.
+         * A limit below size() evicts at once, strong exception guarantee.
+        The limit is copied with the stack, no_size_limit turns it off.
+        */
+        void set_size_limit(size_t n) {
+            if (n == 0) {
+                throw std::invalid_argument(
+                        "Error: size limit must be positive");
+            }
+            if (size() > n) {
+                about_to_modify make_stack_copy(*this, shareable);
+                evict(size() - n);
+                make_stack_copy.drop_roll_back();
+            }
+            limit = n;
+        }
+
+        size_t size_limit() const noexcept {
+            return limit;
+        }
+
+        // Whether the data is shared with other stacks or snapshots, the
+        // next modification then copies it.
+        bool is_shared() const noexcept {
+            return state.use_count() > 1;
+        }
+
+        // Number of stacks and snapshots holding the data, this one
+        // included, 0 if it has none. Approximate while other threads copy.
+        size_t share_count() const noexcept {
+            return static_cast<size_t>(state.use_count());
+        }
+
+        /* Bytes used by the stack, per internal structure. Node sizes are
+        estimated from the usual layouts of the standard library and are
+        exact with pool_allocator, heap memory owned by K and V themselves
+        is not counted. All is shared while the data is, otherwise a key is
+        shared if stacks copied from this one still hold it. While a
+        transaction is active, keys of the elements it removed count as
+        shared.
+         * O(k) with keys held by shared_ptr (k distinct keys), plus
+        O(n + dead log dead) with elements marked by lazy_removal, O(1)
+        otherwise.
+        */
+        stack_memory_usage memory_usage() const noexcept {
+            stack_memory_usage usage;
+            if (!state.use_count()) {
+                return usage;
+            }
+            const bool shared = is_shared();
+            auto add = [shared](stack_memory_usage::part& part, size_t bytes,
+                                bool key_shared = false) {
+                (shared || key_shared ? part.shared : part.exclusive) += bytes;
+            };
+            add(usage.elements, state->main_stack.allocated_bytes());
+            add(usage.index, index_policy::allocated_bytes(state->stacks_map));
+            if constexpr (reclamation_policy::deferred) {
+                add(usage.state, detail::allocation_bytes<Alloc, state_t>() +
+                                 detail::allocation_bytes<Alloc,
+                                         detail::shared_block_layout<
+                                                 state_t*>>());
+            }
+            else {
+                add(usage.state, detail::allocation_bytes<Alloc,
+                        detail::shared_block_layout<state_t>>());
+            }
+            if constexpr (!detail::inline_key<K>) {
+                const size_t bytes = detail::allocation_bytes<
+                        Alloc, detail::shared_block_layout<K>>();
+                dead_key_counts dead_keys(alloc);
+                if constexpr (removal_policy::lazy) {
+                    count_dead_keys(dead_keys);
+                }
+                for (const auto& [key, chain] : state->stacks_map) {
+                    // Held by the index, by the elements of the chain and
+                    // by dead elements.
+                    size_t owners = chain.count + 1;
+                    const auto dead = std::lower_bound(
+                            dead_keys.begin(), dead_keys.end(), key.get(),
+                            dead_key_less());
+                    if (dead != dead_keys.end() && dead->key == key.get()) {
+                        owners += dead->count;
+                        dead->in_index = true;
+                    }
+                    add(usage.keys, bytes,
+                        static_cast<size_t>(key.use_count()) > owners);
+                }
+                // Keys held only by dead elements.
+                for (const dead_key_count& dead : dead_keys) {
+                    if (!dead.in_index) {
+                        add(usage.keys, bytes, dead.uses > dead.count);
+                    }
+                }
+            }
+            return usage;
+        }
+
+        /* Group of push, pop and pop(K const &) with one copy on write and
+        one rollback, made by transaction(): the data is unshared (and dead
+        elements of lazy_removal erased) once when it starts, then every
+        operation changes it in place, without guards of its own, and is
+        logged.
+         * Removed elements are only unlinked from main_stack and the index
+        entries of removed keys are kept, they are destroyed by commit().
+        Destruction without commit, after an exception for example, undoes
+        all operations in O(ops) (O(1) lookups each) and cannot fail: strong
+        exception guarantee for the whole group.
+         * While it is active the stack is unshareable, it may be read but
+        must not be modified other than through the transaction.
+        */
+        class transaction_guard {
+        public:
+            transaction_guard(const transaction_guard&) = delete;
+            transaction_guard& operator=(const transaction_guard&) = delete;
+
+            ~transaction_guard() noexcept {
+                if (active) {
+                    roll_back();
+                }
+            }
+
+            void push(const K& k, const V& v) {
+                push_impl(k, v);
+            }
+
+            void push(K&& k, V&& v) {
+                push_impl(std::move(k), std::move(v));
+            }
+
+            void pop() {
+                make_room(0);
+                if (st.size() == 0) {
+                    throw std::invalid_argument("Error: Empty stack");
+                }
+                state_t& s = *st.state;
+                remove(s.stacks_map.find(s.main_stack.front().key),
+                       s.main_stack.front_handle());
+            }
+
+            void pop(const K& k) {
+                make_room(0);
+                state_t& s = *st.state;
+                const chain_iter_t it = s.stacks_map.find(k);
+                if (it == s.stacks_map.end()) {
+                    throw std::invalid_argument(
+                            "Error: Element with key k does not exist");
+                }
+                remove(it, it->second.top);
+            }
+
+            // Keeps all operations, the transaction ends.
+            void commit() noexcept {
+                if (!active) {
+                    return;
+                }
+                for (const undo_t& u : log) {
+                    if (!u.pushed) {
+                        st.state->main_stack.release(u.elem, spare);
+                    }
+                }
+                log.clear();
+                st.shareable = true;
+                active = false;
+            }
+
+        private:
+            friend class stack;
+
+            using extracted_t =
+                    typename index_policy::template extracted<stacks_map_t>;
+
+            // A push, or a removal of elem which was above below.
+            struct undo_t {
+                bool pushed;
+                handle_t elem;
+                handle_t below;
+                key_chain_t chain; // Chain of elem before the removal.
+                std::optional<extracted_t> erased; // If elem was the last.
+            };
+
+            explicit transaction_guard(stack& s)
+                    : st(s),
+                      spare(rebind_alloc<main_stack_elem_t>(s.alloc)),
+                      log(s.alloc), old_shareable(s.shareable) {
+                s.unshare_state();
+                s.state->purge();
+                old_stale_bottoms = s.state->stale_bottoms;
+                s.shareable = false;
+            }
+
+            // Room in the log for n_pushes pushes and their evictions and in
+            // a hashed index for the keys they add and every erased key to
+            // come back on rollback, so that the rest cannot fail.
+            void make_room(size_t n_pushes) {
+                if (!active) {
+                    throw std::invalid_argument(
+                            "Error: transaction is not active");
+                }
+                const size_t n_entries = 2 * n_pushes + 1;
+                if (log.capacity() - log.size() < n_entries) {
+                    log.reserve(2 * log.size() + n_entries);
+                }
+                stacks_map_t& sm = st.state->stacks_map;
+                if constexpr (requires { sm.keep_room(erased); }) {
+                    sm.keep_room(2 * n_pushes + erased + 1);
+                }
+            }
+
+            template <typename KArg, typename VArg>
+            void push_impl(KArg&& k, VArg&& v) {
+                make_room(1);
+                st.push_unshared(st.state->last_push, std::forward<KArg>(k),
+                                 std::forward<VArg>(v));
+                log.push_back(undo_t{true, handle_t(), handle_t(),
+                                     key_chain_t(), std::nullopt});
+                if (st.size() > st.limit) {
+                    state_t& s = *st.state;
+                    const handle_t bottom = s.main_stack.back_handle();
+                    remove(s.stacks_map.find(s.main_stack[bottom].key),
+                           bottom);
+                }
+            }
+
+            // Unlinks h, the top or the bottom of chain it.
+            void remove(chain_iter_t it, handle_t h) noexcept {
+                state_t& s = *st.state;
+                undo_t& u = log.emplace_back(undo_t{false, h, handle_t(),
+                                                    it->second, std::nullopt});
+                key_chain_t& chain = it->second;
+                if (chain.count == 1) {
+                    if (it == s.last_push) {
+                        s.last_push = s.stacks_map.end();
+                    }
+                    u.erased.emplace(index_policy::extract(s.stacks_map, it));
+                    ++erased;
+                }
+                else if (h == chain.top) {
+                    chain.pop_top(s.main_stack[h].below);
+                }
+                else {
+                    chain.pop_bottom();
+                    s.stale_bottoms = true;
+                }
+                u.below = s.main_stack.detach(h, spare);
+            }
+
+            void roll_back() noexcept {
+                state_t& s = *st.state;
+                for (auto u = log.rbegin(); u != log.rend(); ++u) {
+                    if (u->pushed) {
+                        st.pop_top(s.stacks_map.find(
+                                s.main_stack.front().key));
+                        continue;
+                    }
+                    s.main_stack.attach(u->elem, u->below, spare);
+                    if (u->erased) {
+                        index_policy::restore(s.stacks_map,
+                                              std::move(*u->erased));
+                    }
+                    else {
+                        s.stacks_map.find(s.main_stack[u->elem].key)->second =
+                                u->chain;
+                    }
+                }
+                s.stale_bottoms = old_stale_bottoms;
+                st.shareable = old_shareable;
+                detail::note(stack_event::rollback, 1);
+            }
+
+            stack& st;
+            main_stack_t spare; // Removed elements, with list_storage.
+            std::vector<undo_t, rebind_alloc<undo_t>> log;
+            size_t erased = 0; // Index entries of removed keys.
+            bool old_shareable;
+            bool old_stale_bottoms = false;
+            bool active = true;
         };
 
+        // Lookups are done again on rollback, so they must not throw.
+        transaction_guard transaction()
+                requires index_policy::template nothrow_lookup<K> {
+            return transaction_guard(*this);
+        }
+
         void clear() noexcept {
-            main_stack.reset();
-            stacks_map.reset();
+            state.reset();
+            shareable = true;
+        }
+
+        // Like clear(), but a stack which does not share its data keeps
+        // the storage (slots, hash table) for the following pushes.
+        void clear(keep_capacity_t) noexcept {
+            if (state.use_count() == 1) {
+                state->stacks_map.clear();
+                state->main_stack.clear();
+                state->dead = 0;
+                state->stale_bottoms = false;
+                state->last_push = state->stacks_map.end();
+            }
+            else {
+                state.reset();
+            }
             shareable = true;
         }
 
+        // Makes room for n_elements elements and n_keys distinct keys, so
+        // pushes up to these sizes do not allocate slots (slot_storage) or
+        // rehash (hashed_index). References to values stay valid. Shared
+        // data is copied only if there is room to make.
+        void reserve(size_t n_elements, size_t n_keys) {
+            if (state.use_count() ? state->has_room(n_elements, n_keys,
+                                                    is_shared())
+                                  : n_elements == 0 && n_keys == 0) {
+                return;
+            }
+            about_to_modify make_stack_copy(*this, shareable);
+            state->reserve(n_elements, n_keys);
+            make_stack_copy.drop_roll_back();
+        }
+
+        // Gives back storage which is not in use, by moving the stack to
+        // storage of exactly its size, which invalidates references to
+        // values. That takes a lookup per element, O(n log k) with
+        // ordered_index and expected O(n) with hashed_index. Does nothing if
+        // the data is shared or there is nothing to give back. Erases dead
+        // elements of lazy_removal in place.
+        void shrink_to_fit() {
+            if (state.use_count() != 1) {
+                return;
+            }
+            state->purge();
+            if (state->main_stack.empty()) {
+                clear();
+            }
+            else if (state->has_slack()) {
+                state = compact_state();
+                shareable = true;
+            }
+        }
+
         class const_iterator {
         public:
             using iterator_category = std::forward_iterator_tag;
@@ -338,11 +3138,11 @@ namespace cxx {
             const_iterator& operator=(const_iterator&& other) noexcept = default;
 
             reference operator*() const noexcept {
-                return *map_it->first;
+                return key_of(map_it->first);
             }
 
             pointer operator->() const noexcept {
-                return map_it->first.get();
+                return &key_of(map_it->first);
             }
 
             const_iterator& operator++() noexcept {
@@ -366,21 +3166,334 @@ namespace cxx {
                 return !(a == b);
             }
         private:
+            friend class stack;
+
+            const_iterator(stacks_map_t::const_iterator it,
+                           const state_t* s) noexcept
+                    : map_it(std::move(it)), owner(s),
+                      generation(s->generation) {};
+
             stacks_map_t::const_iterator map_it;
+            // State of map_it, for push_hint. Its address may be taken again
+            // by a later state, which gets another generation.
+            const state_t* owner = nullptr;
+            std::uint64_t generation = 0;
         };
 
         const_iterator cbegin() const noexcept {
-            if (!stacks_map.use_count()) {
+            if (!state.use_count()) {
                 return const_iterator();
             }
-            return const_iterator(stacks_map->cbegin());
+            return const_iterator(state->stacks_map.cbegin(), state.get());
         }
 
         const_iterator cend() const noexcept {
-            if (!stacks_map.use_count()) {
+            if (!state.use_count()) {
                 return const_iterator();
             }
-            return const_iterator(stacks_map->cend());
+            return const_iterator(state->stacks_map.cend(), state.get());
+        }
+
+        /* Iterator over the elements from the top of the stack to the
+        bottom, dereferences to (key, value) like front(). It is multi-pass,
+        but as the reference is a pair of references it is tagged as an input
+        iterator and does not model std::forward_iterator.
+        */
+        class element_iterator {
+        public:
+            using iterator_category = std::input_iterator_tag;
+            using value_type = std::pair<K, V>;
+            using difference_type = ptrdiff_t;
+            using reference = std::pair<const K&, const V&>;
+
+            element_iterator() = default;
+
+            reference operator*() const noexcept {
+                return reference(key_of(it->key), it->value);
+            }
+
+            element_iterator& operator++() noexcept {
+                do {
+                    ++it;
+                } while (it != last && it->mark.dead);
+                return *this;
+            }
+
+            element_iterator operator++(int) noexcept {
+                element_iterator result(*this);
+                operator++();
+                return result;
+            }
+
+            friend bool operator==(const element_iterator& a,
+                                   const element_iterator& b) noexcept {
+                return a.it == b.it;
+            }
+
+        private:
+            using store_iter_t = typename main_stack_t::const_iterator;
+
+            friend class stack;
+
+            element_iterator(store_iter_t i, store_iter_t l) noexcept
+                    : it(i), last(l) {}
+
+            store_iter_t it;
+            store_iter_t last; // Needed to skip dead elements.
+        };
+
+        // Iterator over the values of one key, from the newest.
+        class value_iterator {
+        public:
+            using iterator_category = std::forward_iterator_tag;
+            using value_type = V;
+            using difference_type = ptrdiff_t;
+            using pointer = const V*;
+            using reference = const V&;
+
+            value_iterator() = default;
+
+            reference operator*() const noexcept {
+                return (*store)[pos].value;
+            }
+
+            pointer operator->() const noexcept {
+                return &(*store)[pos].value;
+            }
+
+            value_iterator& operator++() noexcept {
+                if (--left > 0) {
+                    pos = (*store)[pos].below;
+                }
+                return *this;
+            }
+
+            value_iterator operator++(int) noexcept {
+                value_iterator result(*this);
+                operator++();
+                return result;
+            }
+
+            // Iterators of the same key differ by how many values are left.
+            friend bool operator==(const value_iterator& a,
+                                   const value_iterator& b) noexcept {
+                return a.left == b.left;
+            }
+
+        private:
+            friend class stack;
+
+            value_iterator(const main_stack_t* s, handle_t h,
+                           size_t n) noexcept : store(s), pos(h), left(n) {}
+
+            const main_stack_t* store = nullptr;
+            handle_t pos{};
+            size_t left = 0;
+        };
+
+        using element_range = std::ranges::subrange<element_iterator>;
+        using value_range = std::ranges::subrange<value_iterator>;
+
+        /* All elements from the top to the bottom, without copying or
+        marking the stack unshareable. Allocates nothing, takes O(1), every
+        step O(1). Invalidated by any modification of the stack.
+        */
+        element_range elements() const noexcept {
+            if (!state.use_count() || state->main_stack.empty()) {
+                return element_range();
+            }
+            const auto& ms = state->main_stack;
+            return element_range(element_iterator(ms.begin(), ms.end()),
+                                 element_iterator(ms.end(), ms.end()));
+        }
+
+        /* Stack equal to one made by pushing the elements of [first, last)
+        in order (see push_range), built in bulk for large ranges:
+         * Indices of the elements are stable sorted by key with policy
+        (e.g. std::execution::par from <execution>), which groups equal keys
+        in push order. Each key is then copied once, main_stack is built in
+        one pass from the bottom, linking every element to the previous one
+        of its group, and each key is inserted into the index once, at its
+        end, in sorted order.
+         * O(n log n) work in the (parallel) sort, O(n + k) otherwise, no
+        lookups in the index. K must have <. If its comparison (or access to
+        the elements) may throw, policy is not used and the sort runs on the
+        calling thread, so that exceptions reach the caller.
+        */
+        template <typename ForwardIt, typename ExecutionPolicy>
+            requires detail::ordered_key<K>
+        static stack from_range(ForwardIt first, ForwardIt last,
+                                ExecutionPolicy&& policy,
+                                const allocator_type& a = allocator_type()) {
+            stack result(a);
+            const auto n = static_cast<size_t>(std::distance(first, last));
+            if (n == 0) {
+                return result;
+            }
+            using category =
+                    typename std::iterator_traits<ForwardIt>::iterator_category;
+            constexpr bool random_access =
+                    std::is_base_of_v<std::random_access_iterator_tag, category>;
+            using size_vector = std::vector<size_t, rebind_alloc<size_t>>;
+
+            std::vector<ForwardIt, rebind_alloc<ForwardIt>> positions(
+                    result.alloc);
+            if constexpr (!random_access) {
+                positions.reserve(n);
+                for (auto it = first; it != last; ++it) {
+                    positions.push_back(it);
+                }
+            }
+            const auto element = [&](size_t i) {
+                if constexpr (random_access) {
+                    return first + static_cast<std::ptrdiff_t>(i);
+                }
+                else {
+                    return positions[i];
+                }
+            };
+            const auto key_less = [&](size_t i, size_t j) {
+                return static_cast<const K&>(std::get<0>(*element(i))) <
+                       static_cast<const K&>(std::get<0>(*element(j)));
+            };
+
+            size_vector order(n, 0, result.alloc);
+            for (size_t i = 0; i < n; ++i) {
+                order[i] = i;
+            }
+            // Algorithms with a policy call std::terminate if an element
+            // access throws, so throwing keys are sorted without it.
+            constexpr bool nothrow_less = noexcept(
+                    static_cast<const K&>(
+                            std::get<0>(*std::declval<ForwardIt&>())) <
+                    static_cast<const K&>(
+                            std::get<0>(*std::declval<ForwardIt&>())));
+            if constexpr (nothrow_less) {
+                std::stable_sort(std::forward<ExecutionPolicy>(policy),
+                                 order.begin(), order.end(), key_less);
+            }
+            else {
+                std::stable_sort(order.begin(), order.end(), key_less);
+            }
+
+            // Key of every group, and the group of every element.
+            std::vector<key_holder_t, rebind_alloc<key_holder_t>> keys(
+                    result.alloc);
+            size_vector group(n, 0, result.alloc);
+            for (size_t j = 0; j < n; ++j) {
+                if (j == 0 || key_less(order[j - 1], order[j])) {
+                    keys.push_back(result.make_key(static_cast<const K&>(
+                            std::get<0>(*element(order[j])))));
+                }
+                group[order[j]] = keys.size() - 1;
+            }
+
+            state_t& st = *result.state;
+            st.reserve(n, keys.size());
+            std::vector<key_chain_t, rebind_alloc<key_chain_t>> chains(
+                    keys.size(), key_chain_t{handle_t(), 0, handle_t()},
+                    result.alloc);
+            for (size_t i = 0; i < n; ++i, ++first) {
+                key_chain_t& chain = chains[group[i]];
+                auto&& e = *first;
+                st.main_stack.emplace_front(
+                        keys[group[i]], chain.top,
+                        std::get<1>(std::forward<decltype(e)>(e)));
+                chain.top = st.main_stack.front_handle();
+                if (chain.count++ == 0) {
+                    chain.bottom = chain.top;
+                }
+            }
+            for (size_t g = 0; g < keys.size(); ++g) {
+                st.stacks_map.emplace_hint(st.stacks_map.end(),
+                                           std::move(keys[g]), chains[g]);
+            }
+            return result;
+        }
+
+        /* Immutable copy of the stack in sorted, contiguous arrays (see
+        frozen_stack.h, which must be included to call it). Built in O(n)
+        walking every chain once, plus sorting the keys if the index does not
+        keep them sorted. K must have <.
+        */
+        frozen_stack<K, V> freeze() const {
+            frozen_stack<K, V> result;
+            if (!state.use_count() || state->main_stack.empty()) {
+                return result;
+            }
+            const main_stack_t& ms = state->main_stack;
+            using entry_t = typename stacks_map_t::value_type;
+            std::vector<const entry_t*> entries;
+            entries.reserve(state->stacks_map.size());
+            for (const entry_t& entry : state->stacks_map) {
+                entries.push_back(&entry);
+            }
+            const auto key_less = [](const entry_t* a, const entry_t* b) {
+                return key_of(a->first) < key_of(b->first);
+            };
+            if (!std::is_sorted(entries.begin(), entries.end(), key_less)) {
+                std::sort(entries.begin(), entries.end(), key_less);
+            }
+
+            result.keys.reserve(entries.size());
+            result.offsets.reserve(entries.size() + 1);
+            result.values.reserve(size());
+            for (const entry_t* entry : entries) {
+                const key_chain_t& chain = entry->second;
+                if (&ms[chain.top] == &ms.front()) {
+                    result.top = result.keys.size();
+                }
+                result.keys.push_back(key_of(entry->first));
+                result.offsets.push_back(result.values.size());
+                handle_t h = chain.top;
+                for (size_t i = 0; i < chain.count; ++i) {
+                    result.values.push_back(ms[h].value);
+                    h = ms[h].below;
+                }
+            }
+            result.offsets.push_back(result.values.size());
+            return result;
+        }
+
+        /* Like push, with hint for the index: an iterator of this stack to
+        the key k or to the greatest key below it, for example the result of
+        the previous push_hint. Returns an iterator to k.
+         * With ordered_index a right hint makes the lookup and the insertion
+        of a new key take O(1) comparisons, any other hint costs at most two
+        more than push. hashed_index ignores it.
+         * hint must be cend() or valid: modifications invalidate iterators
+        like they do for the index. A hint taken from other data than the
+        stack now holds, i.e. before it (or a copy sharing the data) was
+        copied on write, is not used.
+        */
+        const_iterator push_hint(const_iterator hint, const K& k,
+                                 const V& v) {
+            const chain_iter_t result = push_impl(
+                    hint.owner, hint.generation, hint.map_it, k, v);
+            return const_iterator(result, state.get());
+        }
+
+        const_iterator push_hint(const_iterator hint, K&& k, V&& v) {
+            const chain_iter_t result = push_impl(
+                    hint.owner, hint.generation, hint.map_it, std::move(k),
+                    std::move(v));
+            return const_iterator(result, state.get());
+        }
+
+        // Values with key k from the newest to the oldest, count(k) of them,
+        // empty if there are none. Like elements(), for the chain of k.
+        value_range equal_range(const K& k) const {
+            if (!state.use_count()) {
+                return value_range();
+            }
+            auto key = state->stacks_map.find(k);
+            if (key == state->stacks_map.end()) {
+                return value_range();
+            }
+            return value_range(value_iterator(&state->main_stack,
+                                              key->second.top,
+                                              key->second.count),
+                               value_iterator());
         }
     };
 
@@ -0,0 +1,110 @@
+#ifndef STACK_RECLAIM_H
+#define STACK_RECLAIM_H
+
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <limits>
+#include <mutex>
+#include <thread>
+
+#include "stack.h"
+
+namespace cxx {
+    namespace detail {
+        // Data taken from deferred_states and not destroyed yet.
+        struct reclaim_list {
+            std::mutex guard;
+            reclaimable* pending = nullptr;
+
+            // Whether there is data left, guard must be held.
+            bool busy() const noexcept {
+                return pending != nullptr || !deferred_states.empty();
+            }
+        };
+
+        inline reclaim_list reclaimed;
+    }
+
+    /* Destroys the data released by stacks with deferred_reclamation, at
+    most budget of its elements (an index is destroyed in one step and
+    counts as its size). Data is destroyed in parts, so a budget bounds
+    the pause even for a huge stack. Safe to call from any thread, calls
+    are serialized. Returns the number of states destroyed in full.
+    */
+    inline size_t reclaim(size_t budget = std::numeric_limits<size_t>::max()) {
+        std::lock_guard<std::mutex> lock(detail::reclaimed.guard);
+        detail::reclaimable*& pending = detail::reclaimed.pending;
+        size_t destroyed = 0;
+        while (budget > 0) {
+            if (pending == nullptr) {
+                pending = detail::deferred_states.take_all();
+                if (pending == nullptr) {
+                    break;
+                }
+            }
+            detail::reclaimable* next = pending->next;
+            if (!pending->release(pending, budget)) {
+                break;
+            }
+            pending = next;
+            ++destroyed;
+        }
+        return destroyed;
+    }
+
+    // Whether there is released data left to reclaim.
+    inline bool reclaim_pending() {
+        std::lock_guard<std::mutex> lock(detail::reclaimed.guard);
+        return detail::reclaimed.busy();
+    }
+
+    /* Thread which calls reclaim(batch_size) until nothing is left and
+    then checks again every check_interval. The destructor stops it, data released
+    after that stays for reclaim().
+    */
+    class background_reclaimer {
+    public:
+        explicit background_reclaimer(
+                std::chrono::milliseconds check_interval =
+                        std::chrono::milliseconds(10),
+                size_t batch_size = 4096)
+                : interval(check_interval), batch(batch_size),
+                  worker([this] { run(); }) {}
+
+        background_reclaimer(const background_reclaimer&) = delete;
+        background_reclaimer& operator=(const background_reclaimer&) = delete;
+
+        ~background_reclaimer() {
+            {
+                std::lock_guard<std::mutex> lock(guard);
+                stopping = true;
+            }
+            wake.notify_one();
+            worker.join();
+        }
+
+    private:
+        const std::chrono::milliseconds interval;
+        const size_t batch;
+        std::mutex guard;
+        std::condition_variable wake;
+        bool stopping = false;
+        std::thread worker; // Last, started when the rest is ready.
+
+        void run() {
+            std::unique_lock<std::mutex> lock(guard);
+            while (!stopping) {
+                lock.unlock();
+                reclaim(batch);
+                const bool left = reclaim_pending();
+                lock.lock();
+                if (!left) {
+                    wake.wait_for(lock, interval, [this] { return stopping; });
+                }
+            }
+        }
+    };
+}
+
+#endif //STACK_RECLAIM_H
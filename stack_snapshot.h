@@ -0,0 +1,573 @@
+#ifndef STACK_SNAPSHOT_H
+#define STACK_SNAPSHOT_H
+
+#include <algorithm>
+#include <array>
+#include <bit>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <limits>
+#include <ostream>
+#include <span>
+#include <stdexcept>
+#include <type_traits>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#if __has_include(<sys/mman.h>)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <cerrno>
+#include <system_error>
+#endif
+
+#include "stack.h"
+
+namespace cxx {
+    namespace detail {
+        // Alignment of the sections of a snapshot.
+        inline constexpr std::size_t snapshot_align = 16;
+
+        // Snapshots hold objects as raw bytes, so only for such K and V,
+        // whose alignment the sections keep for stack_view.
+        template <typename T>
+        concept snapshot_type = std::is_trivially_copyable_v<T> &&
+                                alignof(T) <= snapshot_align;
+
+        // Key and value types of a cxx::stack.
+        template <typename Stack> struct stack_types;
+
+        template <typename K, typename V, typename... Options>
+        struct stack_types<stack<K, V, Options...>> {
+            using key_type = K;
+            using value_type = V;
+        };
+
+        /* Snapshot format, in the byte order of the machine:
+         * header, then 4 sections, each starting at a multiple of
+        snapshot_align from the beginning:
+         * keys: K[key_count], each key once, sorted by < if the flag is set.
+         * chains: snapshot_chain[key_count], top and count of each key.
+         * element_keys: uint32_t[element_count], key of each element as its
+        index in keys, from the bottom of the stack to the top.
+         * values: V[element_count], in the same order.
+        */
+        struct snapshot_header {
+            char magic[8];
+            std::uint32_t version;
+            std::uint32_t byte_order;
+            std::uint32_t key_size, key_align;
+            std::uint32_t value_size, value_align;
+            std::uint64_t key_count;
+            std::uint64_t element_count;
+            std::uint32_t flags;
+            std::uint32_t reserved;
+        };
+
+        struct snapshot_chain {
+            std::uint64_t top; // Position of newest element, 0 is the bottom.
+            std::uint64_t count;
+        };
+
+        inline constexpr char snapshot_magic[8] = {'c', 'x', 'x', 's',
+                                                   't', 'a', 'c', 'k'};
+        inline constexpr std::uint32_t snapshot_version = 1;
+        inline constexpr std::uint32_t snapshot_byte_order = 0x01020304;
+        inline constexpr std::uint32_t snapshot_sorted = 1;
+
+        // Offsets of the sections, checked against overflow.
+        struct snapshot_layout {
+            std::size_t keys, chains, element_keys, values, total;
+
+            static std::size_t align_up(std::size_t n) {
+                if (n > std::numeric_limits<std::size_t>::max() -
+                        snapshot_align) {
+                    throw std::invalid_argument("Error: snapshot too large");
+                }
+                return (n + snapshot_align - 1) / snapshot_align *
+                       snapshot_align;
+            }
+
+            static std::size_t section_end(std::size_t begin, std::uint64_t n,
+                                           std::size_t size) {
+                const auto max = std::numeric_limits<std::size_t>::max();
+                if (n > (max - begin) / size) {
+                    throw std::invalid_argument("Error: snapshot too large");
+                }
+                return begin + static_cast<std::size_t>(n) * size;
+            }
+
+            template <typename K, typename V>
+            static snapshot_layout of(std::uint64_t n_keys,
+                                      std::uint64_t n_elements) {
+                snapshot_layout l{};
+                l.keys = align_up(sizeof(snapshot_header));
+                l.chains = align_up(section_end(l.keys, n_keys, sizeof(K)));
+                l.element_keys = align_up(section_end(
+                        l.chains, n_keys, sizeof(snapshot_chain)));
+                l.values = align_up(section_end(
+                        l.element_keys, n_elements, sizeof(std::uint32_t)));
+                l.total = section_end(l.values, n_elements, sizeof(V));
+                return l;
+            }
+        };
+
+        template <typename K, typename V>
+        snapshot_header make_snapshot_header(std::uint64_t n_keys,
+                                             std::uint64_t n_elements,
+                                             bool sorted) {
+            snapshot_header h{};
+            std::memcpy(h.magic, snapshot_magic, sizeof(h.magic));
+            h.version = snapshot_version;
+            h.byte_order = snapshot_byte_order;
+            h.key_size = sizeof(K);
+            h.key_align = alignof(K);
+            h.value_size = sizeof(V);
+            h.value_align = alignof(V);
+            h.key_count = n_keys;
+            h.element_count = n_elements;
+            h.flags = sorted ? snapshot_sorted : 0;
+            return h;
+        }
+
+        // Header of data, which must be a snapshot of K and V.
+        template <typename K, typename V>
+        snapshot_header read_snapshot_header(std::span<const std::byte> data) {
+            snapshot_header h;
+            if (data.size() < sizeof(h)) {
+                throw std::invalid_argument("Error: snapshot truncated");
+            }
+            std::memcpy(&h, data.data(), sizeof(h));
+            if (std::memcmp(h.magic, snapshot_magic, sizeof(h.magic)) != 0 ||
+                h.version != snapshot_version) {
+                throw std::invalid_argument("Error: not a stack snapshot");
+            }
+            if (h.byte_order != snapshot_byte_order ||
+                h.key_size != sizeof(K) || h.key_align != alignof(K) ||
+                h.value_size != sizeof(V) || h.value_align != alignof(V)) {
+                throw std::invalid_argument("Error: snapshot of other types");
+            }
+            if (snapshot_layout::of<K, V>(h.key_count, h.element_count)
+                        .total > data.size()) {
+                throw std::invalid_argument("Error: snapshot truncated");
+            }
+            return h;
+        }
+
+        template <typename T>
+        T read_object(const std::byte* p) noexcept {
+            std::array<std::byte, sizeof(T)> bytes;
+            std::memcpy(bytes.data(), p, sizeof(T));
+            return std::bit_cast<T>(bytes);
+        }
+
+        // Writes sections and their padding to out, in blocks of
+        // buffer_size bytes rather than one call per object.
+        class snapshot_writer {
+        public:
+            static constexpr std::size_t buffer_size = 64 * 1024;
+
+            explicit snapshot_writer(std::ostream& o) : out(o), buffer(),
+                                                        offset(0) {
+                buffer.reserve(buffer_size);
+            }
+
+            void write(const void* p, std::size_t n) {
+                const char* bytes = static_cast<const char*>(p);
+                if (buffer.size() + n > buffer_size) {
+                    flush();
+                }
+                if (n >= buffer_size) {
+                    out.write(bytes, static_cast<std::streamsize>(n));
+                }
+                else {
+                    buffer.insert(buffer.end(), bytes, bytes + n);
+                }
+                offset += n;
+            }
+
+            void pad_to(std::size_t position) {
+                static constexpr char zeros[snapshot_align] = {};
+                write(zeros, position - offset);
+            }
+
+            // Writes the rest, throws if out failed.
+            void finish() {
+                flush();
+                if (!out) {
+                    throw std::invalid_argument(
+                            "Error: snapshot stream failed");
+                }
+            }
+
+        private:
+            std::ostream& out;
+            std::vector<char> buffer;
+            std::size_t offset;
+
+            void flush() {
+                out.write(buffer.data(),
+                          static_cast<std::streamsize>(buffer.size()));
+                buffer.clear();
+            }
+        };
+
+        // Reads and builds the private data of stacks.
+        struct snapshot_access {
+            template <typename K, typename V, typename... Options>
+            static void serialize(const stack<K, V, Options...>& s,
+                                  std::ostream& out) {
+                if (!s.state.use_count()) {
+                    serialize(stack<K, V, Options...>(), out);
+                    return;
+                }
+                const auto& st = *s.state;
+                if (st.stacks_map.size() >
+                    std::numeric_limits<std::uint32_t>::max()) {
+                    throw std::invalid_argument(
+                            "Error: too many keys for snapshot");
+                }
+
+                // Keys in index order, which for ordered_index is sorted.
+                std::vector<const K*> keys;
+                keys.reserve(st.stacks_map.size());
+                for (const auto& entry : st.stacks_map) {
+                    keys.push_back(&s.key_of(entry.first));
+                }
+                constexpr bool sorted = ordered_key<K>;
+
+                // Key of every element, from the bottom.
+                std::vector<std::uint32_t> element_keys;
+                element_keys.reserve(st.main_stack.size());
+                if constexpr (sorted) {
+                    const auto key_less = [](const K* a, const K* b) {
+                        return *a < *b;
+                    };
+                    if (!std::is_sorted(keys.begin(), keys.end(), key_less)) {
+                        std::sort(keys.begin(), keys.end(), key_less);
+                    }
+                    for (auto elem = st.main_stack.end();
+                         elem != st.main_stack.begin();) {
+                        --elem;
+                        if (elem->mark.dead) {
+                            continue;
+                        }
+                        const K& k = s.key_of(elem->key);
+                        element_keys.push_back(static_cast<std::uint32_t>(
+                                std::lower_bound(keys.begin(), keys.end(), &k,
+                                                 key_less) - keys.begin()));
+                    }
+                }
+                else {
+                    std::unordered_map<K, std::uint32_t> index;
+                    index.reserve(keys.size());
+                    for (std::uint32_t i = 0; i < keys.size(); ++i) {
+                        index.emplace(*keys[i], i);
+                    }
+                    for (auto elem = st.main_stack.end();
+                         elem != st.main_stack.begin();) {
+                        --elem;
+                        if (elem->mark.dead) {
+                            continue;
+                        }
+                        element_keys.push_back(
+                                index.find(s.key_of(elem->key))->second);
+                    }
+                }
+
+                std::vector<snapshot_chain> chains(keys.size(),
+                                                   snapshot_chain{0, 0});
+                for (std::size_t i = 0; i < element_keys.size(); ++i) {
+                    chains[element_keys[i]].top = i;
+                    ++chains[element_keys[i]].count;
+                }
+
+                const auto layout = snapshot_layout::of<K, V>(
+                        keys.size(), element_keys.size());
+                const auto header = make_snapshot_header<K, V>(
+                        keys.size(), element_keys.size(), sorted);
+                snapshot_writer w(out);
+                w.write(&header, sizeof(header));
+                w.pad_to(layout.keys);
+                for (const K* k : keys) {
+                    w.write(k, sizeof(K));
+                }
+                w.pad_to(layout.chains);
+                w.write(chains.data(), chains.size() * sizeof(snapshot_chain));
+                w.pad_to(layout.element_keys);
+                w.write(element_keys.data(),
+                        element_keys.size() * sizeof(std::uint32_t));
+                w.pad_to(layout.values);
+                for (auto elem = st.main_stack.end();
+                     elem != st.main_stack.begin();) {
+                    --elem;
+                    if (!elem->mark.dead) {
+                        w.write(&elem->value, sizeof(V));
+                    }
+                }
+                w.finish();
+            }
+
+            /* Builds the state directly in O(n): storage is reserved for the
+            exact sizes, elements are pushed from the bottom and every key is
+            inserted once, at the end of the index if keys are sorted.
+            */
+            template <typename Stack>
+            static Stack load(std::span<const std::byte> data,
+                              const typename Stack::allocator_type& a) {
+                using K = typename stack_types<Stack>::key_type;
+                using V = typename stack_types<Stack>::value_type;
+                using key_holder_t = typename Stack::key_holder_t;
+                using handle_t = typename Stack::handle_t;
+                using key_chain_t = typename Stack::key_chain_t;
+
+                const snapshot_header h = read_snapshot_header<K, V>(data);
+                const auto layout = snapshot_layout::of<K, V>(
+                        h.key_count, h.element_count);
+                const std::byte* base = data.data();
+                const auto n_keys = static_cast<std::size_t>(h.key_count);
+                const auto n = static_cast<std::size_t>(h.element_count);
+
+                Stack s(a);
+                auto& st = *s.state;
+                st.reserve(n, n_keys);
+
+                std::vector<key_holder_t> keys;
+                keys.reserve(n_keys);
+                for (std::size_t i = 0; i < n_keys; ++i) {
+                    keys.push_back(s.make_key(read_object<K>(
+                            base + layout.keys + i * sizeof(K))));
+                }
+
+                std::vector<key_chain_t> chains(
+                        n_keys, key_chain_t{handle_t(), 0, handle_t()});
+                for (std::size_t i = 0; i < n; ++i) {
+                    const auto k = read_object<std::uint32_t>(
+                            base + layout.element_keys +
+                            i * sizeof(std::uint32_t));
+                    if (k >= n_keys) {
+                        throw std::invalid_argument(
+                                "Error: corrupt snapshot");
+                    }
+                    st.main_stack.emplace_front(
+                            keys[k], chains[k].top,
+                            read_object<V>(base + layout.values +
+                                           i * sizeof(V)));
+                    chains[k].top = st.main_stack.front_handle();
+                    if (chains[k].count++ == 0) {
+                        chains[k].bottom = chains[k].top;
+                    }
+                }
+
+                for (std::size_t i = 0; i < n_keys; ++i) {
+                    if (chains[i].count == 0) {
+                        throw std::invalid_argument(
+                                "Error: corrupt snapshot");
+                    }
+                    st.stacks_map.emplace_hint(st.stacks_map.end(), keys[i],
+                                               chains[i]);
+                }
+                if (st.stacks_map.size() != n_keys) {
+                    throw std::invalid_argument("Error: corrupt snapshot");
+                }
+                return s;
+            }
+        };
+    }
+
+    /* Writes s in the binary snapshot format to out (e.g. a std::ofstream
+    opened in binary mode or a std::ostringstream as a buffer): every key
+    once, then the key of every element as an index and the values, from
+    the bottom of the stack. Keys are sorted if K has <, which load and
+    stack_view use. K and V must be trivially copyable. Throws
+    std::invalid_argument if out fails.
+    */
+    template <typename K, typename V, typename... Options>
+        requires detail::snapshot_type<K> && detail::snapshot_type<V>
+    void serialize(const stack<K, V, Options...>& s, std::ostream& out) {
+        detail::snapshot_access::serialize(s, out);
+    }
+
+    /* Stack equal to the serialized one, built in O(n) (O(n log n) for
+    ordered_index if keys of K without < were serialized). Data may be
+    aligned anyhow. Throws std::invalid_argument if data is not a snapshot
+    of the same K and V (sizes and byte order are checked) or is corrupt.
+    */
+    template <typename Stack>
+        requires detail::snapshot_type<
+                         typename detail::stack_types<Stack>::key_type> &&
+                 detail::snapshot_type<
+                         typename detail::stack_types<Stack>::value_type>
+    Stack load_stack(std::span<const std::byte> data,
+                     const typename Stack::allocator_type& a = {}) {
+        return detail::snapshot_access::load<Stack>(data, a);
+    }
+
+    /* Read-only stack over a snapshot in memory (for example mapped by
+    mapped_stack), which copies nothing: front and size take O(1), count(k)
+    and front(k) binary search over the sorted keys, iteration visits the
+    keys in sorted order. The data must outlive the view and be aligned to
+    16 bytes, K must have <. Lookups throw std::invalid_argument like stack.
+    */
+    template <typename K, typename V>
+        requires detail::snapshot_type<K> && detail::snapshot_type<V> &&
+                 detail::ordered_key<K>
+    class stack_view {
+    public:
+        using const_iterator = const K*;
+
+        explicit stack_view(std::span<const std::byte> data) {
+            if (reinterpret_cast<std::uintptr_t>(data.data()) %
+                detail::snapshot_align) {
+                throw std::invalid_argument("Error: snapshot misaligned");
+            }
+            const auto h = detail::read_snapshot_header<K, V>(data);
+            if (!(h.flags & detail::snapshot_sorted)) {
+                throw std::invalid_argument("Error: snapshot keys not sorted");
+            }
+            const auto layout = detail::snapshot_layout::of<K, V>(
+                    h.key_count, h.element_count);
+            const std::byte* base = data.data();
+            keys = reinterpret_cast<const K*>(base + layout.keys);
+            chains = reinterpret_cast<const detail::snapshot_chain*>(
+                    base + layout.chains);
+            element_keys = reinterpret_cast<const std::uint32_t*>(
+                    base + layout.element_keys);
+            values = reinterpret_cast<const V*>(base + layout.values);
+            key_count = static_cast<size_t>(h.key_count);
+            element_count = static_cast<size_t>(h.element_count);
+        }
+
+        size_t size() const noexcept {
+            return element_count;
+        }
+
+        size_t count(const K& k) const {
+            const detail::snapshot_chain* chain = find(k);
+            return chain ? static_cast<size_t>(chain->count) : 0;
+        }
+
+        std::pair<const K&, const V&> front() const {
+            if (element_count == 0) {
+                throw std::invalid_argument("Error: empty stack");
+            }
+            const std::uint32_t k = element_keys[element_count - 1];
+            if (k >= key_count) {
+                throw std::invalid_argument("Error: corrupt snapshot");
+            }
+            return {keys[k], values[element_count - 1]};
+        }
+
+        const V& front(const K& k) const {
+            const detail::snapshot_chain* chain = find(k);
+            if (!chain) {
+                throw std::invalid_argument(
+                        "Error: stack does not contain given key");
+            }
+            if (chain->top >= element_count) {
+                throw std::invalid_argument("Error: corrupt snapshot");
+            }
+            return values[chain->top];
+        }
+
+        const_iterator cbegin() const noexcept {
+            return keys;
+        }
+
+        const_iterator cend() const noexcept {
+            return keys + key_count;
+        }
+
+    private:
+        const K* keys = nullptr;
+        const detail::snapshot_chain* chains = nullptr;
+        const std::uint32_t* element_keys = nullptr;
+        const V* values = nullptr;
+        size_t key_count = 0;
+        size_t element_count = 0;
+
+        const detail::snapshot_chain* find(const K& k) const {
+            const K* it = std::lower_bound(keys, keys + key_count, k);
+            if (it == keys + key_count || k < *it) {
+                return nullptr;
+            }
+            return chains + (it - keys);
+        }
+    };
+
+#if __has_include(<sys/mman.h>)
+    /* Snapshot file mapped read-only into memory, served by a stack_view.
+    Pages are read by the system on first access, so opening takes O(1)
+    apart from the checks of the view. Throws std::system_error if the
+    file cannot be mapped.
+    */
+    template <typename K, typename V>
+    class mapped_stack {
+    public:
+        explicit mapped_stack(const char* path)
+                : region(map(path)), stack_view_(checked_view(region)) {}
+
+        mapped_stack(const mapped_stack&) = delete;
+        mapped_stack& operator=(const mapped_stack&) = delete;
+
+        ~mapped_stack() noexcept {
+            ::munmap(const_cast<std::byte*>(region.data()), region.size());
+        }
+
+        const stack_view<K, V>& view() const noexcept {
+            return stack_view_;
+        }
+
+        // Mapped bytes, e.g. for load_stack.
+        std::span<const std::byte> bytes() const noexcept {
+            return region;
+        }
+
+    private:
+        static std::span<const std::byte> map(const char* path) {
+            const int fd = ::open(path, O_RDONLY);
+            if (fd < 0) {
+                throw std::system_error(errno, std::generic_category(), path);
+            }
+            struct stat info {};
+            if (::fstat(fd, &info) != 0) {
+                const int error = errno;
+                ::close(fd);
+                throw std::system_error(error, std::generic_category(), path);
+            }
+            if (info.st_size == 0) {
+                ::close(fd);
+                throw std::system_error(EINVAL, std::generic_category(), path);
+            }
+            const auto size = static_cast<size_t>(info.st_size);
+            void* p = ::mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+            const int error = errno;
+            ::close(fd);
+            if (p == MAP_FAILED) {
+                throw std::system_error(error, std::generic_category(), path);
+            }
+            return {static_cast<const std::byte*>(p), size};
+        }
+
+        // Unmaps the region if the view rejects it.
+        static stack_view<K, V> checked_view(std::span<const std::byte> r) {
+            try {
+                return stack_view<K, V>(r);
+            }
+            catch (...) {
+                ::munmap(const_cast<std::byte*>(r.data()), r.size());
+                throw;
+            }
+        }
+
+        std::span<const std::byte> region;
+        stack_view<K, V> stack_view_;
+    };
+#endif
+}
+
+#endif //STACK_SNAPSHOT_H
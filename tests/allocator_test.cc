@@ -0,0 +1,146 @@
+#include "stack.h"
+
+#include <cassert>
+#include <cstddef>
+#include <cstdlib>
+#include <functional>
+#include <new>
+#include <utility>
+#include <vector>
+
+namespace {
+    // Allocations by the replaced global operator new below.
+    long global_news = 0;
+
+    struct allocator_counts {
+        long allocs = 0;
+        long deallocs = 0;
+        long bytes = 0; // Allocated and not deallocated yet.
+    };
+    allocator_counts counted;
+
+    // Counts every allocation, takes memory from malloc so that it is not
+    // counted as a global new.
+    template <typename T> class counting_allocator {
+    public:
+        using value_type = T;
+
+        counting_allocator() noexcept = default;
+
+        template <typename U>
+        counting_allocator(const counting_allocator<U>&) noexcept {}
+
+        T* allocate(std::size_t n) {
+            if (void* p = std::malloc(n * sizeof(T))) {
+                ++counted.allocs;
+                counted.bytes += static_cast<long>(n * sizeof(T));
+                return static_cast<T*>(p);
+            }
+            throw std::bad_alloc();
+        }
+
+        void deallocate(T* p, std::size_t n) noexcept {
+            ++counted.deallocs;
+            counted.bytes -= static_cast<long>(n * sizeof(T));
+            std::free(p);
+        }
+
+        template <typename U>
+        friend bool operator==(const counting_allocator&,
+                               const counting_allocator<U>&) noexcept {
+            return true;
+        }
+    };
+
+    // Too large to be held inline, so keys are held by shared_ptr.
+    struct wide_key {
+        long k[4] = {};
+        wide_key(long x) : k{x} {}
+        friend bool operator<(const wide_key& a, const wide_key& b) {
+            return a.k[0] < b.k[0];
+        }
+        friend bool operator==(const wide_key& a, const wide_key& b) {
+            return a.k[0] == b.k[0];
+        }
+    };
+}
+
+template <> struct std::hash<wide_key> {
+    size_t operator()(const wide_key& k) const noexcept {
+        return std::hash<long>()(k.k[0]);
+    }
+};
+
+void* operator new(std::size_t n) {
+    ++global_news;
+    if (void* p = std::malloc(n ? n : 1)) {
+        return p;
+    }
+    throw std::bad_alloc();
+}
+
+void operator delete(void* p) noexcept {
+    std::free(p);
+}
+
+void operator delete(void* p, std::size_t) noexcept {
+    std::free(p);
+}
+
+namespace {
+    /* Every internal allocation of the stack goes through Alloc: push, pop,
+    copy on write, reserve, bulk push, compaction and clear take nothing
+    from global new, and all of it is given back by the end.
+    */
+    template <typename K, typename... Options>
+    void test_all_through_allocator() {
+        using Stack = cxx::stack<K, int, Options...,
+                counting_allocator<std::pair<const K, int>>>;
+        std::vector<std::pair<K, int>> batch;
+        for (int i = 0; i < 100; ++i) {
+            batch.emplace_back(K(i % 23), i);
+        }
+
+        counted = {};
+        const long news = global_news;
+        {
+            Stack s;
+            for (int i = 0; i < 200; ++i) {
+                s.push(K(i % 17), i);
+            }
+            s.pop();
+            s.pop(K(3));
+            Stack copy = s;
+            s.push(K(40), 1); // Copy on write.
+            s.reserve(500, 60);
+            s.push_range(batch.begin(), batch.end());
+            for (int i = 0; i < 150; ++i) {
+                s.pop();
+            }
+            s.shrink_to_fit();
+            s.clear(cxx::keep_capacity);
+            s.push(K(1), 1);
+            const Stack other = s;
+            copy.clear();
+            s.clear();
+        }
+        assert(global_news == news);
+        assert(counted.allocs > 0);
+        assert(counted.allocs == counted.deallocs);
+        assert(counted.bytes == 0);
+    }
+
+    template <typename... Options>
+    void test_all() {
+        test_all_through_allocator<int, Options...>();
+        test_all_through_allocator<wide_key, Options...>();
+    }
+}
+
+int main() {
+    test_all<>();
+    test_all<cxx::slot_storage>();
+    test_all<cxx::hashed_index>();
+    test_all<cxx::lazy_removal<25>>();
+    test_all<cxx::slot_storage, cxx::hashed_index, cxx::lazy_removal<50>>();
+}
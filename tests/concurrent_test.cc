@@ -0,0 +1,110 @@
+#include "stack.h"
+#include "concurrent_stack.h"
+#include "persistent_stack.h"
+#include "test_util.h"
+
+#include <atomic>
+#include <cassert>
+#include <thread>
+#include <vector>
+
+using test::contents_t;
+using test::popped;
+
+namespace {
+    template <typename Stack>
+    void test_single_thread() {
+        cxx::concurrent_stack<int, int, Stack> s;
+        const auto empty = s.snapshot();
+        s.push(1, 10);
+        s.push(2, 20);
+        s.push(1, 30);
+        const auto three = s.snapshot();
+        s.pop(1);
+        s.update([](Stack& t) {
+            t.push(3, 40);
+            t.pop();
+            t.push(4, 50);
+        });
+        assert(popped(*s.snapshot()) == contents_t({{4, 50}, {2, 20}, {1, 10}}));
+        // Snapshots never change.
+        assert(empty->size() == 0);
+        assert(popped(*three) == contents_t({{1, 30}, {2, 20}, {1, 10}}));
+        assert(three->count(1) == 2 && three->front(2) == 20);
+        s.clear();
+        assert(s.snapshot()->size() == 0);
+
+        // If an update throws, nothing is published.
+        s.push(5, 60);
+        const auto before = s.snapshot();
+        bool caught = false;
+        try {
+            s.update([](Stack& t) {
+                t.push(6, 70);
+                throw test::injected_error();
+            });
+        }
+        catch (test::injected_error&) {
+            caught = true;
+        }
+        assert(caught && s.snapshot() == before);
+        caught = false;
+        try {
+            cxx::concurrent_stack<int, int, Stack>().pop();
+        }
+        catch (std::invalid_argument&) {
+            caught = true;
+        }
+        assert(caught);
+    }
+
+    // Every update pushes or pops a pair of elements with keys 0 and 1,
+    // readers never see half of one.
+    template <typename Stack>
+    void test_readers() {
+        cxx::concurrent_stack<int, int, Stack> s;
+        std::atomic<bool> done{false};
+        std::vector<std::thread> readers;
+        for (int r = 0; r < 4; ++r) {
+            readers.emplace_back([&] {
+                while (!done.load()) {
+                    const auto snap = s.snapshot();
+                    assert(snap->size() % 2 == 0);
+                    assert(snap->count(0) == snap->count(1));
+                    if (snap->size() > 0) {
+                        assert(snap->front().first == 1);
+                        assert(snap->front(0) + 1 == snap->front(1));
+                    }
+                }
+            });
+        }
+        for (int i = 0; i < 2000; ++i) {
+            if (i % 3 == 2) {
+                s.update([](Stack& t) {
+                    t.pop();
+                    t.pop();
+                });
+            }
+            else {
+                s.update([i](Stack& t) {
+                    t.push(0, 2 * i);
+                    t.push(1, 2 * i + 1);
+                });
+            }
+        }
+        done = true;
+        for (std::thread& t : readers) {
+            t.join();
+        }
+        assert(s.snapshot()->size() % 2 == 0);
+    }
+}
+
+int main() {
+    test_single_thread<cxx::stack<int, int>>();
+    test_single_thread<cxx::stack<int, int, cxx::slot_storage,
+                                  cxx::hashed_index>>();
+    test_single_thread<cxx::persistent_stack<int, int>>();
+    test_readers<cxx::stack<int, int>>();
+    test_readers<cxx::persistent_stack<int, int>>();
+}
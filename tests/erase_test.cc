@@ -0,0 +1,142 @@
+#define CXX_STACK_STATS
+#include "stack.h"
+#include "test_util.h"
+
+#include <cassert>
+#include <map>
+
+using test::check;
+using test::contents_t;
+
+namespace {
+    // Elements of c without those whose keys are in [lo, hi).
+    contents_t without(const contents_t& c, int lo, int hi) {
+        contents_t r;
+        for (const auto& e : c) {
+            if (e.first < lo || e.first >= hi) {
+                r.push_back(e);
+            }
+        }
+        return r;
+    }
+
+    template <typename Stack>
+    Stack make(contents_t& c) {
+        Stack s;
+        c.clear();
+        for (int i = 0; i < 200; ++i) {
+            s.push(i * 7 % 23, i);
+            c.insert(c.begin(), {i * 7 % 23, i});
+        }
+        return s;
+    }
+
+    template <typename Stack>
+    void test_erase_key() {
+        contents_t c;
+        Stack s = make<Stack>(c);
+        const size_t n = s.count(5);
+        assert(s.erase_key(5) == n && n > 0);
+        c = without(c, 5, 6);
+        check(s, c);
+        assert(s.erase_key(5) == 0);
+        assert(s.erase_key(100) == 0);
+        check(s, c);
+        for (int k = 0; k < 23; ++k) {
+            s.erase_key(k);
+        }
+        check(s, {});
+        s.push(1, 1);
+        check(s, {{1, 1}});
+    }
+
+    template <typename Stack>
+    void test_erase_range() {
+        contents_t c;
+        Stack s = make<Stack>(c);
+        size_t n = 0;
+        for (int k = 3; k < 9; ++k) {
+            n += s.count(k);
+        }
+        assert(s.count_range(3, 9) == n);
+        assert(s.erase_range(3, 9) == n);
+        c = without(c, 3, 9);
+        check(s, c);
+        assert(s.count_range(3, 9) == 0);
+        assert(s.erase_range(3, 9) == 0);
+        assert(s.erase_range(9, 3) == 0);
+        assert(s.erase_range(30, 40) == 0);
+        check(s, c);
+        assert(s.erase_range(-1, 100) == c.size());
+        check(s, {});
+        assert(Stack().count_range(0, 1) == 0);
+    }
+
+    // A miss does not copy shared data and is not a rollback.
+    template <typename Stack>
+    void test_miss_keeps_sharing() {
+        contents_t c;
+        Stack s = make<Stack>(c);
+        const Stack copy(s);
+        cxx::reset_stack_stats();
+        assert(s.erase_key(100) == 0);
+        if constexpr (requires { s.erase_range(30, 40); }) {
+            assert(s.erase_range(30, 40) == 0);
+        }
+        const cxx::stack_stats stats = cxx::get_stack_stats();
+        assert(stats.cow_copies == 0 && stats.elements_cloned == 0);
+        assert(stats.rollbacks == 0);
+        assert(s.is_shared() && copy.share_count() == 2);
+
+        // A hit copies the data and leaves the copy alone.
+        assert(s.erase_key(5) > 0);
+        assert(!s.is_shared());
+        assert(cxx::get_stack_stats().cow_copies == 1);
+        check(copy, c);
+        check(s, without(c, 5, 6));
+    }
+
+    template <typename Stack>
+    void test_erase_strong() {
+        for (bool shared : {false, true}) {
+            contents_t c;
+            Stack s = make<Stack>(c);
+            const Stack copy(s);
+            if (!shared) {
+                s.front();
+            }
+            test::check_strong(s, [](Stack& t) { t.erase_key(5); });
+            check(s, without(c, 5, 6));
+            if constexpr (requires { s.erase_range(3, 9); }) {
+                test::check_strong(s, [](Stack& t) { t.erase_range(3, 9); });
+                check(s, without(c, 3, 9));
+            }
+            check(copy, c);
+        }
+    }
+
+    template <typename... Options>
+    void test_all() {
+        using plain = cxx::stack<int, int, Options...>;
+        using throwing = cxx::stack<test::key, test::value, Options...>;
+        test_erase_key<plain>();
+        test_erase_key<throwing>();
+        test_miss_keeps_sharing<plain>();
+        test_erase_strong<throwing>();
+    }
+
+    template <typename... Options>
+    void test_ordered() {
+        test_all<Options...>();
+        test_erase_range<cxx::stack<int, int, Options...>>();
+        test_erase_range<cxx::stack<test::key, test::value, Options...>>();
+    }
+}
+
+int main() {
+    test_ordered<>();
+    test_ordered<cxx::slot_storage>();
+    test_ordered<cxx::lazy_removal<50>>();
+    test_all<cxx::hashed_index>();
+    test_all<cxx::slot_storage, cxx::hashed_index, cxx::lazy_removal<25>>();
+}
@@ -0,0 +1,107 @@
+#include "stack.h"
+#include "frozen_stack.h"
+#include "test_util.h"
+
+#include <algorithm>
+#include <cassert>
+#include <random>
+#include <stdexcept>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+namespace {
+    template <typename Fn>
+    bool rejects(Fn fn) {
+        try {
+            fn();
+        }
+        catch (std::invalid_argument&) {
+            return true;
+        }
+        return false;
+    }
+
+    // Compares a frozen stack with its source.
+    template <typename Stack, typename Frozen>
+    void check_frozen(const Stack& s, const Frozen& f) {
+        assert(f.size() == s.size());
+        if (s.size() == 0) {
+            assert(rejects([&] { f.front(); }));
+            assert(f.cbegin() == f.cend());
+            return;
+        }
+        assert(f.front().first == s.front().first);
+        assert(f.front().second == s.front().second);
+
+        std::vector<std::decay_t<decltype(*s.cbegin())>> keys(s.cbegin(),
+                                                           s.cend());
+        std::sort(keys.begin(), keys.end());
+        assert(std::equal(keys.begin(), keys.end(), f.cbegin(), f.cend()));
+        for (const auto& k : keys) {
+            assert(f.count(k) == s.count(k));
+            assert(f.front(k) == s.front(k));
+            const auto values = f.equal_range(k);
+            const auto expected = s.equal_range(k);
+            assert(std::equal(values.begin(), values.end(), expected.begin(),
+                              expected.end()));
+        }
+    }
+
+    template <typename Stack>
+    void test_freeze(unsigned seed) {
+        std::mt19937 gen(seed);
+        Stack s;
+        check_frozen(s, s.freeze());
+        for (int i = 0; i < 2000; ++i) {
+            s.push(static_cast<int>(gen() % 300), i);
+        }
+        // Tombstones of lazy_removal, and keys removed completely.
+        for (int i = 0; i < 600; ++i) {
+            const int k = static_cast<int>(gen() % 300);
+            if (s.count(k) > 0) {
+                s.pop(k);
+            }
+        }
+        s.pop();
+        const Stack copy(s);
+        const auto frozen = s.freeze();
+        check_frozen(s, frozen);
+        // freeze() neither copies nor unshares the data.
+        assert(s.is_shared());
+
+        // Missing keys.
+        assert(frozen.count(-1) == 0 && frozen.count(1000) == 0);
+        assert(frozen.equal_range(-1).empty());
+        assert(rejects([&] { frozen.front(1000); }));
+
+        // The frozen stack does not change with the source.
+        s.push(-5, -5);
+        s.pop(*frozen.cbegin());
+        assert(frozen.size() == copy.size());
+        check_frozen(copy, frozen);
+
+        s.clear();
+        check_frozen(s, s.freeze());
+    }
+
+    void test_string_keys() {
+        cxx::stack<std::string, int, cxx::hashed_index> s;
+        for (int i = 0; i < 100; ++i) {
+            s.push(std::to_string(i % 17), i);
+        }
+        s.pop("3");
+        check_frozen(s, s.freeze());
+    }
+}
+
+int main() {
+    test_freeze<cxx::stack<int, int>>(1);
+    test_freeze<cxx::stack<int, int, cxx::slot_storage>>(2);
+    // Keys are not sorted in the index.
+    test_freeze<cxx::stack<int, int, cxx::hashed_index>>(3);
+    test_freeze<cxx::stack<int, int, cxx::lazy_removal<90>>>(4);
+    test_freeze<cxx::stack<int, int, cxx::hashed_index,
+                           cxx::lazy_removal<50>, cxx::slot_storage>>(5);
+    test_string_keys();
+}
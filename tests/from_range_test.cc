@@ -0,0 +1,94 @@
+#include "stack.h"
+#include "test_util.h"
+
+#include <cassert>
+#include <execution>
+#include <list>
+#include <utility>
+#include <vector>
+
+using test::check;
+using test::contents_t;
+
+namespace {
+    // Elements from the bottom, with many keys repeated.
+    contents_t make_input(int n) {
+        contents_t input;
+        for (int i = 0; i < n; ++i) {
+            input.emplace_back(i * 7 % 31, i);
+        }
+        return input;
+    }
+
+    contents_t pushed(const contents_t& input) {
+        return contents_t(input.rbegin(), input.rend());
+    }
+
+    // from_range equals pushing the range in order, for random access and
+    // forward iterators.
+    template <typename Stack>
+    void test_equal() {
+        for (int n : {0, 1, 2, 500}) {
+            const contents_t input = make_input(n);
+            Stack pushes;
+            for (const auto& [k, v] : input) {
+                pushes.push(k, v);
+            }
+            const Stack s = Stack::from_range(input.begin(), input.end(),
+                                              std::execution::seq);
+            check(s, test::contents(pushes));
+            check(s, pushed(input));
+
+            const std::list<std::pair<int, int>> list(input.begin(),
+                                                      input.end());
+            const Stack from_list = Stack::from_range(
+                    list.begin(), list.end(), std::execution::seq);
+            check(from_list, pushed(input));
+
+            // The result is an ordinary stack.
+            Stack copy(s);
+            copy.push(3, -1);
+            check(s, pushed(input));
+            contents_t c = pushed(input);
+            c.insert(c.begin(), {3, -1});
+            check(copy, c);
+        }
+    }
+
+    // Exceptions of keys and values reach the caller, also from the sort.
+    template <typename Stack>
+    void test_throwing() {
+        const contents_t plain_input = make_input(100);
+        const std::vector<std::pair<test::key, test::value>> input(
+                plain_input.begin(), plain_input.end());
+        size_t failures = 0;
+        for (long n = 1;; ++n) {
+            test::countdown = n;
+            try {
+                const Stack s = Stack::from_range(input.begin(), input.end(),
+                                                  std::execution::seq);
+                test::countdown = 0;
+                check(s, pushed(plain_input));
+                break;
+            }
+            catch (const test::injected_error&) {
+                ++failures;
+            }
+        }
+        test::countdown = 0;
+        assert(failures > 0);
+    }
+
+    template <typename... Options>
+    void test_all() {
+        test_equal<cxx::stack<int, int, Options...>>();
+        test_throwing<cxx::stack<test::key, test::value, Options...>>();
+    }
+}
+
+int main() {
+    test_all<>();
+    test_all<cxx::slot_storage>();
+    test_all<cxx::hashed_index>();
+    test_all<cxx::slot_storage, cxx::hashed_index, cxx::lazy_removal<25>>();
+}
@@ -0,0 +1,103 @@
+#include "stack.h"
+#include "test_util.h"
+
+#include <cassert>
+#include <string>
+
+namespace {
+    template <typename Stack>
+    Stack make() {
+        Stack s;
+        for (int i = 0; i < 100; ++i) {
+            s.push(std::to_string(i % 10), i);
+        }
+        return s;
+    }
+
+    template <typename Stack>
+    void test_sharing() {
+        const Stack empty;
+        assert(!empty.is_shared() && empty.share_count() == 1);
+        assert(empty.memory_usage().elements.total() == 0);
+        assert(empty.memory_usage().shared() == 0);
+
+        Stack s = make<Stack>();
+        assert(!s.is_shared() && s.share_count() == 1);
+        const cxx::stack_memory_usage alone = s.memory_usage();
+        assert(alone.shared() == 0);
+        assert(alone.elements.exclusive > 0 && alone.index.exclusive > 0);
+        assert(alone.keys.exclusive > 0 && alone.state.exclusive > 0);
+
+        // All is shared with a copy, and counted by both.
+        {
+            const Stack copy(s);
+            assert(s.is_shared() && copy.is_shared());
+            assert(s.share_count() == 2 && copy.share_count() == 2);
+            const cxx::stack_memory_usage shared = s.memory_usage();
+            assert(shared.exclusive() == 0);
+            assert(shared.shared() == alone.exclusive());
+            assert(copy.memory_usage().shared() == shared.shared());
+
+            // After copy on write only the keys are still shared.
+            s.push("x", 0);
+            assert(!s.is_shared() && !copy.is_shared());
+            const cxx::stack_memory_usage own = s.memory_usage();
+            assert(own.elements.shared == 0 && own.index.shared == 0);
+            assert(own.state.shared == 0);
+            assert(own.keys.shared == alone.keys.exclusive);
+            assert(own.keys.exclusive > 0);
+            s.pop("x");
+        }
+        assert(!s.is_shared() && s.share_count() == 1);
+        assert(s.memory_usage().shared() == 0);
+
+        // A non-const front reference makes copies deep.
+        s.front();
+        const Stack deep(s);
+        assert(!s.is_shared() && !deep.is_shared());
+        s.clear();
+        assert(s.share_count() == 0 && s.memory_usage().exclusive() == 0);
+    }
+
+    // Dead elements of lazy_removal still hold their keys, which are not
+    // shared with anything.
+    template <typename Stack>
+    void test_dead_keys() {
+        Stack s = make<Stack>();
+        s.pop("3");
+        s.pop("5");
+        s.pop("5");
+        assert(!s.is_shared());
+        const cxx::stack_memory_usage usage = s.memory_usage();
+        assert(usage.shared() == 0);
+        assert(usage.keys.exclusive == make<Stack>().memory_usage().keys.exclusive);
+
+        // Keys held only by dead elements.
+        Stack t;
+        t.push("a", 1);
+        t.push("b", 2);
+        t.push("c", 3);
+        t.pop("a");
+        assert(t.memory_usage().shared() == 0);
+        {
+            const Stack copy(t);
+            t.push("d", 4);
+            assert(t.memory_usage().keys.shared > 0);
+        }
+        assert(t.memory_usage().shared() == 0);
+    }
+
+    template <typename... Options>
+    void test_all() {
+        test_sharing<cxx::stack<std::string, int, Options...>>();
+        test_dead_keys<cxx::stack<std::string, int, Options...>>();
+    }
+}
+
+int main() {
+    test_all<>();
+    test_all<cxx::slot_storage>();
+    test_all<cxx::hashed_index>();
+    test_all<cxx::lazy_removal<50>>();
+    test_all<cxx::slot_storage, cxx::hashed_index, cxx::lazy_removal<90>>();
+}
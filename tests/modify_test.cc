@@ -0,0 +1,105 @@
+#define CXX_STACK_STATS
+#include "stack.h"
+#include "test_util.h"
+
+#include <cassert>
+#include <stdexcept>
+
+using test::check;
+using test::contents_t;
+
+namespace {
+    template <typename Stack>
+    void test_modify() {
+        Stack s;
+        s.push(1, 10);
+        s.push(2, 20);
+        s.push(1, 30);
+        assert(s.modify_front([](auto& v) { v = 31; return 5; }) == 5);
+        s.modify(2, [](auto& v) { v = 21; });
+        check(s, {{1, 31}, {2, 21}, {1, 10}});
+
+        // The stack stays shareable: copies share data and do not see
+        // later modifications.
+        const Stack copy(s);
+        assert(s.is_shared());
+        s.modify(1, [](auto& v) { v = 32; });
+        assert(!s.is_shared());
+        check(copy, {{1, 31}, {2, 21}, {1, 10}});
+        check(s, {{1, 32}, {2, 21}, {1, 10}});
+        const Stack again(s);
+        assert(s.is_shared() && again.share_count() == 2);
+
+        bool caught = false;
+        try {
+            Stack().modify_front([](auto&) {});
+        }
+        catch (std::invalid_argument&) {
+            caught = true;
+        }
+        assert(caught);
+    }
+
+    // A missing key throws before shared data is copied.
+    template <typename Stack>
+    void test_modify_miss() {
+        Stack s;
+        for (int i = 0; i < 1000; ++i) {
+            s.push(i, i);
+        }
+        const Stack copy(s);
+        cxx::reset_stack_stats();
+        bool caught = false;
+        try {
+            s.modify(-1, [](auto&) {});
+        }
+        catch (std::invalid_argument&) {
+            caught = true;
+        }
+        assert(caught);
+        const cxx::stack_stats stats = cxx::get_stack_stats();
+        assert(stats.cow_copies == 0 && stats.elements_cloned == 0);
+        assert(stats.rollbacks == 0);
+        assert(s.is_shared() && copy.share_count() == 2);
+        caught = false;
+        try {
+            Stack().modify(1, [](auto&) {});
+        }
+        catch (std::invalid_argument&) {
+            caught = true;
+        }
+        assert(caught);
+    }
+
+    // If fn throws, shared data stays as it was.
+    template <typename Stack>
+    void test_modify_throws() {
+        Stack s;
+        s.push(1, 10);
+        s.push(2, 20);
+        const Stack copy(s);
+        const contents_t before = test::contents(s);
+        test::check_strong(s, [](Stack& t) {
+            t.modify(1, [](auto& v) {
+                test::may_throw();
+                v = 11;
+            });
+        });
+        check(s, {{2, 20}, {1, 11}});
+        check(copy, before);
+    }
+
+    template <typename... Options>
+    void test_all() {
+        test_modify<cxx::stack<int, int, Options...>>();
+        test_modify_miss<cxx::stack<int, int, Options...>>();
+        test_modify_throws<cxx::stack<test::key, test::value, Options...>>();
+    }
+}
+
+int main() {
+    test_all<>();
+    test_all<cxx::slot_storage>();
+    test_all<cxx::hashed_index>();
+    test_all<cxx::lazy_removal<50>>();
+}
@@ -0,0 +1,206 @@
+#include "persistent_stack.h"
+#include "test_util.h"
+
+#include <cassert>
+#include <map>
+#include <random>
+#include <stdexcept>
+#include <vector>
+
+using test::contents_t;
+using test::plain;
+
+namespace {
+    // Checks s against its elements c, which persistent_stack does not
+    // iterate: they are taken by popping a copy.
+    template <typename Stack>
+    void check_popped(const Stack& s, const contents_t& c) {
+        const long saved = test::countdown;
+        test::countdown = 0;
+        assert(test::popped(s) == c);
+        assert(s.size() == c.size());
+        std::map<int, std::pair<size_t, int>> keys;
+        for (auto it = c.rbegin(); it != c.rend(); ++it) {
+            auto& [n, top] = keys[it->first];
+            ++n;
+            top = it->second;
+        }
+        auto key = keys.begin();
+        for (auto it = s.cbegin(); it != s.cend(); ++it, ++key) {
+            assert(plain(*it) == key->first);
+            assert(s.count(*it) == key->second.first);
+            assert(plain(s.front(*it)) == key->second.second);
+        }
+        assert(key == keys.end());
+        test::countdown = saved;
+    }
+
+    // Like test::check_strong, with check_popped.
+    template <typename Stack, typename Op>
+    void check_strong_popped(Stack& s, Op op) {
+        const contents_t before = test::popped(s);
+        for (long n = 1;; ++n) {
+            test::countdown = n;
+            try {
+                op(s);
+                test::countdown = 0;
+                return;
+            }
+            catch (const test::injected_error&) {
+                test::countdown = 0;
+                check_popped(s, before);
+            }
+        }
+    }
+
+    void model_pop(contents_t& m, int k) {
+        for (auto it = m.begin(); it != m.end(); ++it) {
+            if (it->first == k) {
+                m.erase(it);
+                return;
+            }
+        }
+    }
+
+    // Random operations against a model, with copies which must keep
+    // their contents while the stack changes.
+    template <typename Stack, bool Strong>
+    void test_differential(unsigned seed, int steps) {
+        std::mt19937 gen(seed);
+        auto rand = [&gen](int n) {
+            return static_cast<int>(gen() % static_cast<unsigned>(n));
+        };
+        auto run = [](Stack& s, auto op) {
+            if constexpr (Strong) {
+                check_strong_popped(s, op);
+            }
+            else {
+                op(s);
+            }
+        };
+
+        Stack s;
+        contents_t m;
+        std::vector<std::pair<Stack, contents_t>> copies;
+        for (int step = 0; step < steps; ++step) {
+            const int k = rand(16), v = step;
+            switch (rand(9)) {
+                case 0: case 1: case 2:
+                    run(s, [k, v](Stack& t) { t.push(k, v); });
+                    m.insert(m.begin(), {k, v});
+                    break;
+                case 3:
+                    if (!m.empty()) {
+                        run(s, [](Stack& t) { t.pop(); });
+                        m.erase(m.begin());
+                    }
+                    break;
+                case 4:
+                    if (s.count(k) > 0) {
+                        run(s, [k](Stack& t) { t.pop(k); });
+                        model_pop(m, k);
+                    }
+                    break;
+                case 5:
+                    if (s.count(k) > 0) {
+                        s.modify(k, [v](auto& x) { x = v; });
+                        for (auto& e : m) {
+                            if (e.first == k) {
+                                e.second = v;
+                                break;
+                            }
+                        }
+                    }
+                    break;
+                case 6:
+                    if (copies.size() < 8) {
+                        copies.emplace_back(s, m);
+                    }
+                    break;
+                case 7:
+                    // A reference from non-const front makes copies deep.
+                    if (!m.empty()) {
+                        auto& top = s.front().second;
+                        const Stack deep(s);
+                        top = v;
+                        check_popped(deep, m);
+                        m.front().second = v;
+                    }
+                    break;
+                default:
+                    if (rand(10) == 0) {
+                        s.clear();
+                        m.clear();
+                    }
+                    break;
+            }
+            check_popped(s, m);
+        }
+        for (const auto& [copy, copy_m] : copies) {
+            check_popped(copy, copy_m);
+        }
+        bool caught = false;
+        try {
+            s.pop(-1);
+        }
+        catch (std::invalid_argument&) {
+            caught = true;
+        }
+        assert(caught);
+    }
+
+    // A moved-from stack is empty and can be copied and used, also when
+    // references from non-const front were out.
+    void test_moved_from() {
+        cxx::persistent_stack<int, int> s;
+        s.push(1, 10);
+        s.push(2, 20);
+        s.front().second = 30;
+        cxx::persistent_stack<int, int> moved(std::move(s));
+        const cxx::persistent_stack<int, int> copy(s);
+        assert(copy.size() == 0 && s.size() == 0);
+        s.push(3, 40);
+        check_popped(s, {{3, 40}});
+        check_popped(moved, {{2, 30}, {1, 10}});
+    }
+
+    // References taken again and again to the same elements are all kept
+    // apart from copies.
+    void test_exposed() {
+        cxx::persistent_stack<int, int> s;
+        s.push(1, 10);
+        s.push(2, 20);
+        for (int i = 0; i < 1000; ++i) {
+            s.front(1) = i;
+            s.front(2) = -i;
+        }
+        int& one = s.front(1);
+        int& two = s.front(2);
+        const cxx::persistent_stack<int, int> copy(s);
+        one = 5;
+        two = 6;
+        check_popped(copy, {{2, -999}, {1, 999}});
+        check_popped(s, {{2, 6}, {1, 5}});
+    }
+
+    // Long stacks are released without deep recursion.
+    void test_long() {
+        cxx::persistent_stack<int, int> s;
+        for (int i = 0; i < 200000; ++i) {
+            s.push(i % 2, i);
+        }
+        const cxx::persistent_stack<int, int> copy(s);
+        s.pop(0);
+        assert(copy.size() == 200000 && s.size() == 199999);
+        assert(copy.front(0) == 199998 && s.front(0) == 199996);
+    }
+}
+
+int main() {
+    test_differential<cxx::persistent_stack<int, int>, false>(1, 2000);
+    test_differential<cxx::persistent_stack<test::key, test::value>, true>(
+            2, 600);
+    test_moved_from();
+    test_exposed();
+    test_long();
+}
@@ -0,0 +1,235 @@
+#include "stack.h"
+#include "pool_allocator.h"
+#include "test_util.h"
+
+#include <cassert>
+#include <cstdint>
+#include <functional>
+#include <random>
+#include <stdexcept>
+#include <utility>
+#include <vector>
+
+using test::check;
+using test::contents_t;
+
+namespace {
+    // Removes the newest element with key k from the model.
+    void model_pop(contents_t& m, int k) {
+        for (auto it = m.begin(); it != m.end(); ++it) {
+            if (it->first == k) {
+                m.erase(it);
+                return;
+            }
+        }
+    }
+
+    bool model_has(const contents_t& m, int k) {
+        for (const auto& e : m) {
+            if (e.first == k) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    /* Random operations on a stack compared with a model after each one.
+    Copies taken on the way must keep their contents while the stack
+    changes. With Strong, every operation is run by check_strong, so each
+    of its throwing steps is made to fail once first.
+    */
+    template <typename Stack, bool Strong>
+    void test_differential(unsigned seed, int steps) {
+        std::mt19937 gen(seed);
+        auto rand = [&gen](int n) {
+            return static_cast<int>(gen() % static_cast<unsigned>(n));
+        };
+        auto run = [](Stack& s, auto op) {
+            if constexpr (Strong) {
+                test::check_strong(s, op);
+            }
+            else {
+                op(s);
+            }
+        };
+
+        Stack s;
+        contents_t m;
+        Stack copy;
+        contents_t copy_m;
+        for (int step = 0; step < steps; ++step) {
+            const int keys = step < steps / 2 ? 8 : 64;
+            const int k = rand(keys), v = step;
+            switch (rand(12)) {
+                case 0: case 1: case 2: case 3:
+                    run(s, [k, v](Stack& t) { t.push(k, v); });
+                    m.insert(m.begin(), {k, v});
+                    break;
+                case 4:
+                    if (!m.empty()) {
+                        run(s, [](Stack& t) { t.pop(); });
+                        m.erase(m.begin());
+                    }
+                    break;
+                case 5:
+                    if (model_has(m, k)) {
+                        run(s, [k](Stack& t) { t.pop(k); });
+                        model_pop(m, k);
+                    }
+                    break;
+                case 6: {
+                    const size_t n = m.empty() ? 0 : rand(3) % m.size();
+                    run(s, [n](Stack& t) { t.pop_n(n); });
+                    m.erase(m.begin(), m.begin() + n);
+                    break;
+                }
+                case 7: {
+                    std::vector<std::pair<int, int>> batch;
+                    for (int i = 0; i < 3; ++i) {
+                        batch.emplace_back(rand(keys), v * 10 + i);
+                        m.insert(m.begin(), batch.back());
+                    }
+                    run(s, [&batch](Stack& t) {
+                        t.push_range(batch.begin(), batch.end());
+                    });
+                    break;
+                }
+                case 8:
+                    if (model_has(m, k)) {
+                        run(s, [k, v](Stack& t) {
+                            t.modify(k, [v](auto& x) { x = v; });
+                        });
+                        for (auto& e : m) {
+                            if (e.first == k) {
+                                e.second = v;
+                                break;
+                            }
+                        }
+                    }
+                    break;
+                case 9:
+                    copy = s;
+                    copy_m = m;
+                    break;
+                case 10:
+                    // A reference from non-const front makes copies deep.
+                    if (!m.empty()) {
+                        auto& top = s.front().second;
+                        const Stack deep(s);
+                        top = v;
+                        check(deep, m);
+                        m.front().second = v;
+                    }
+                    break;
+                default:
+                    if (rand(8) == 0) {
+                        s.clear();
+                        m.clear();
+                    }
+                    break;
+            }
+            check(s, m);
+            check(copy, copy_m);
+        }
+        bool caught = false;
+        try {
+            s.pop(-1);
+        }
+        catch (std::invalid_argument&) {
+            caught = true;
+        }
+        assert(caught);
+        check(s, m);
+    }
+
+    // Key counting its comparisons for equality, hashed by std::hash of
+    // the integer (identity).
+    struct counted_key {
+        std::uint64_t k = 0;
+        inline static long compares = 0;
+        friend bool operator==(const counted_key& a, const counted_key& b) {
+            ++compares;
+            return a.k == b.k;
+        }
+        friend bool operator<(const counted_key& a, const counted_key& b) {
+            return a.k < b.k;
+        }
+    };
+}
+
+template <> struct std::hash<counted_key> {
+    size_t operator()(const counted_key& k) const {
+        return std::hash<std::uint64_t>()(k.k);
+    }
+};
+
+namespace {
+    // Keys which differ only in their high bits (aligned ids, pointers)
+    // must not all meet in one probe sequence of hashed_index.
+    void test_strided_keys() {
+        constexpr std::uint64_t n = 4096;
+        for (const int stride : {16, 20, 40}) {
+            cxx::stack<counted_key, int, cxx::hashed_index> s;
+            for (std::uint64_t i = 0; i < n; ++i) {
+                s.push(counted_key{i << stride}, static_cast<int>(i));
+            }
+            counted_key::compares = 0;
+            for (std::uint64_t i = 0; i < n; ++i) {
+                assert(s.count(counted_key{i << stride}) == 1);
+            }
+            assert(counted_key::compares < static_cast<long>(2 * n));
+        }
+    }
+
+    // A batch of new keys makes the index rehash while it is pushed, which
+    // must not lose the chains needed to roll it back. A batch with few
+    // distinct keys must not size the index for its length.
+    void test_push_range_rehash() {
+        using Stack = cxx::stack<test::key, test::value, cxx::hashed_index>;
+        Stack s;
+        s.push(0, 0);
+        contents_t m{{0, 0}};
+        std::vector<std::pair<int, int>> batch;
+        for (int i = 1; i <= 40; ++i) {
+            batch.emplace_back(i % 2 == 0 ? i : 0, i);
+            m.insert(m.begin(), batch.back());
+        }
+        assert(test::check_strong(s, [&batch](Stack& t) {
+            t.push_range(batch.begin(), batch.end());
+        }) > 0);
+        check(s, m);
+
+        using Ints = cxx::stack<int, int, cxx::hashed_index>;
+        std::vector<std::pair<int, int>> dup;
+        for (int i = 0; i < 100000; ++i) {
+            dup.emplace_back(i % 16, i);
+        }
+        Ints batched, one_by_one;
+        batched.push_range(dup.begin(), dup.end());
+        for (const auto& [k, v] : dup) {
+            one_by_one.push(k, v);
+        }
+        assert(batched.memory_usage().index.total() <=
+               2 * one_by_one.memory_usage().index.total());
+    }
+
+    template <typename... Options>
+    void test_all() {
+        test_differential<cxx::stack<int, int, Options...>, false>(1, 3000);
+        test_differential<cxx::stack<test::key, test::value, Options...>,
+                          true>(2, 600);
+    }
+}
+
+int main() {
+    test_all<>();
+    test_all<cxx::slot_storage>();
+    test_all<cxx::hashed_index>();
+    test_all<cxx::slot_storage, cxx::hashed_index>();
+    test_strided_keys();
+    test_push_range_rehash();
+    test_all<cxx::lazy_removal<25>>();
+    test_all<cxx::hashed_index, cxx::lazy_removal<50>, cxx::slot_storage>();
+    test_differential<cxx::stack<int, int,
+            cxx::pool_allocator<std::pair<const int, int>>>, false>(3, 2000);
+}
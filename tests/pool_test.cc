@@ -0,0 +1,30 @@
+#include "pool_allocator.h"
+
+#include <cassert>
+#include <cstddef>
+#include <thread>
+
+namespace {
+    // Threads which come and go, each allocating blocks of another size
+    // class, carve them from the bump regions left by the previous ones
+    // instead of taking a chunk each.
+    void test_finished_threads() {
+        constexpr std::size_t threads = 64;
+        const std::size_t before = cxx::pool_allocator<char>::reserved_bytes();
+        for (std::size_t i = 0; i < threads; ++i) {
+            std::thread([i] {
+                cxx::pool_allocator<char> a;
+                const std::size_t n = 16 * (i % 32 + 1);
+                char* p = a.allocate(n);
+                a.deallocate(p, n);
+            }).join();
+        }
+        const std::size_t grown =
+                cxx::pool_allocator<char>::reserved_bytes() - before;
+        assert(grown <= threads / 4 * 64 * 1024);
+    }
+}
+
+int main() {
+    test_finished_threads();
+}
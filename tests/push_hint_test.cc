@@ -0,0 +1,115 @@
+#include "stack.h"
+#include "pool_allocator.h"
+#include "test_util.h"
+
+#include <cassert>
+#include <utility>
+
+using test::check;
+using test::contents_t;
+
+namespace {
+    // Right, wrong and end hints give the same stack as push.
+    template <typename Stack>
+    void test_hints() {
+        Stack s;
+        contents_t c;
+        auto it = s.push_hint(s.cend(), 0, 0);
+        c.insert(c.begin(), {0, 0});
+        for (int i = 1; i < 200; ++i) {
+            // The returned iterator is a right hint for the same and the
+            // next key.
+            it = s.push_hint(it, i / 2, i);
+            assert(*it == i / 2);
+            c.insert(c.begin(), {i / 2, i});
+        }
+        check(s, c);
+        for (int i = 0; i < 50; ++i) {
+            const int k = (i * 37) % 120;
+            it = s.push_hint(i % 2 ? s.cbegin() : s.cend(), k, -i);
+            assert(*it == k);
+            c.insert(c.begin(), {k, -i});
+        }
+        check(s, c);
+    }
+
+    // The cached chain of the last pushed key is dropped with its key.
+    template <typename Stack>
+    void test_last_push() {
+        Stack s;
+        s.push(1, 10);
+        s.push(2, 20);
+        s.pop(2);
+        s.push(2, 30);
+        s.pop();
+        s.push(3, 40);
+        s.erase_key(3);
+        s.push(3, 50);
+        s.push(3, 60);
+        check(s, {{3, 60}, {3, 50}, {1, 10}});
+        s.clear();
+        s.push(3, 70);
+        check(s, {{3, 70}});
+        Stack copy(s);
+        s.push(3, 80);
+        copy.push(3, 90);
+        check(s, {{3, 80}, {3, 70}});
+        check(copy, {{3, 90}, {3, 70}});
+    }
+
+    // Hints from data which was since copied on write are not used, so
+    // they cannot modify the copy holding that data.
+    template <typename Stack>
+    void test_stale_hint() {
+        Stack a;
+        auto it = a.push_hint(a.cend(), 1, 1);
+        Stack b = a;
+        a.push(3, 3);
+        a.push_hint(it, 1, 7);
+        check(a, {{1, 7}, {3, 3}, {1, 1}});
+        check(b, {{1, 1}});
+
+        // Copy on write within push_hint.
+        it = a.cbegin();
+        const Stack c = a;
+        a.push_hint(it, 1, 8);
+        check(a, {{1, 8}, {1, 7}, {3, 3}, {1, 1}});
+        check(c, {{1, 7}, {3, 3}, {1, 1}});
+    }
+
+    // A hint from a freed state is not used by a state which was since
+    // allocated at its address. The pool reuses the freed block at once.
+    template <typename Stack>
+    void test_reused_state() {
+        Stack a;
+        a.push(5, 5);
+        const auto it = a.push_hint(a.cend(), 1, 1);
+        {
+            const Stack b = a;
+            a.push(3, 3); // a copies on write, b keeps the hinted state.
+        }
+        const Stack c = a;
+        a.push(4, 4); // The new state may take the address of the old one.
+        a.push_hint(it, 1, 7);
+        check(a, {{1, 7}, {4, 4}, {3, 3}, {1, 1}, {5, 5}});
+        check(c, {{3, 3}, {1, 1}, {5, 5}});
+    }
+
+    template <typename... Options>
+    void test_all() {
+        test_hints<cxx::stack<int, int, Options...>>();
+        test_last_push<cxx::stack<int, int, Options...>>();
+        test_stale_hint<cxx::stack<int, int, Options...>>();
+        test_reused_state<cxx::stack<int, int, Options...>>();
+        test_reused_state<cxx::stack<int, int, Options...,
+                cxx::pool_allocator<std::pair<const int, int>>>>();
+    }
+}
+
+int main() {
+    test_all<>();
+    test_all<cxx::slot_storage>();
+    test_all<cxx::hashed_index>();
+    test_all<cxx::lazy_removal<2>>();
+    test_all<cxx::slot_storage, cxx::hashed_index, cxx::lazy_removal<50>>();
+}
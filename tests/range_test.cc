@@ -0,0 +1,107 @@
+#include "stack.h"
+#include "test_util.h"
+
+#include <cassert>
+#include <iterator>
+#include <ranges>
+#include <string>
+#include <vector>
+
+using test::contents_t;
+
+namespace {
+    void model_pop(contents_t& m, int k) {
+        for (auto it = m.begin(); it != m.end(); ++it) {
+            if (it->first == k) {
+                m.erase(it);
+                return;
+            }
+        }
+    }
+
+    template <typename Stack>
+    std::vector<int> values_of(const Stack& s, int k) {
+        std::vector<int> result;
+        for (const int& v : s.equal_range(k)) {
+            result.push_back(v);
+        }
+        return result;
+    }
+
+    template <typename Stack>
+    void test_ranges() {
+        Stack s;
+        assert(s.elements().empty() && s.equal_range(1).empty());
+        contents_t c;
+        for (int i = 0; i < 60; ++i) {
+            s.push(i % 5, i);
+            c.insert(c.begin(), {i % 5, i});
+        }
+        // Removed elements (tombstones of lazy_removal) are skipped.
+        for (int k : {2, 2, 0}) {
+            s.pop(k);
+            model_pop(c, k);
+        }
+        s.pop();
+        c.erase(c.begin());
+
+        // Read while a copy shares the data.
+        const Stack copy(s);
+        contents_t elements;
+        for (const auto& [k, v] : s.elements()) {
+            elements.emplace_back(k, v);
+        }
+        assert(elements == c);
+        assert(static_cast<size_t>(std::ranges::distance(s.elements())) ==
+               s.size());
+
+        // Per key from the newest to the oldest, count(k) of them.
+        for (int k = 0; k < 5; ++k) {
+            std::vector<int> expected;
+            for (const auto& [ek, ev] : c) {
+                if (ek == k) {
+                    expected.push_back(ev);
+                }
+            }
+            assert(values_of(s, k) == expected);
+            assert(static_cast<size_t>(
+                           std::ranges::distance(s.equal_range(k))) ==
+                   s.count(k));
+        }
+        assert(s.equal_range(-1).empty() && s.equal_range(5).empty());
+
+        // Neither call unshares the stack.
+        assert(s.is_shared() && copy.is_shared() && s.share_count() == 2);
+
+        s.clear();
+        assert(s.elements().empty() && s.equal_range(1).empty());
+    }
+
+    void test_string_keys() {
+        cxx::stack<std::string, int> s;
+        s.push("a", 1);
+        s.push("b", 2);
+        s.push("a", 3);
+        contents_t c;
+        std::vector<std::string> keys;
+        for (const auto& [k, v] : s.elements()) {
+            keys.push_back(k);
+            c.emplace_back(0, v);
+        }
+        assert((keys == std::vector<std::string>{"a", "b", "a"}));
+        assert((c == contents_t{{0, 3}, {0, 2}, {0, 1}}));
+        const auto a = s.equal_range("a");
+        assert((std::vector<int>(a.begin(), a.end()) ==
+                std::vector<int>{3, 1}));
+    }
+}
+
+int main() {
+    test_ranges<cxx::stack<int, int>>();
+    test_ranges<cxx::stack<int, int, cxx::slot_storage>>();
+    test_ranges<cxx::stack<int, int, cxx::hashed_index>>();
+    test_ranges<cxx::stack<int, int, cxx::lazy_removal<90>>>();
+    test_ranges<cxx::stack<int, int, cxx::slot_storage, cxx::hashed_index,
+                           cxx::lazy_removal<50>>>();
+    test_string_keys();
+}
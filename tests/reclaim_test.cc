@@ -0,0 +1,126 @@
+#include "stack.h"
+#include "stack_reclaim.h"
+#include "test_util.h"
+
+#include <atomic>
+#include <cassert>
+#include <chrono>
+#include <thread>
+
+using test::check;
+
+namespace {
+    std::atomic<long> live{0};
+
+    // Counts its live instances.
+    struct counted {
+        int v;
+        counted(int x) : v(x) {
+            ++live;
+        }
+        counted(const counted& o) : v(o.v) {
+            ++live;
+        }
+        ~counted() {
+            --live;
+        }
+    };
+
+    void drain() {
+        while (cxx::reclaim_pending()) {
+            cxx::reclaim(100);
+        }
+    }
+
+    // Data released by clear, destruction, assignment and copy on write is
+    // destroyed only by reclaim, in parts of at most the budget.
+    template <typename Stack>
+    void test_deferred() {
+        {
+            Stack s;
+            for (int i = 0; i < 1000; ++i) {
+                s.push(i % 37, counted(i));
+            }
+            Stack copy(s);
+            copy.push(1, counted(1));
+            s.clear();
+            assert(s.size() == 0 && copy.size() == 1001);
+            s.push(3, counted(3));
+            copy.erase_key(7);
+            Stack other;
+            other.push(1, counted(1));
+            other = s;
+        }
+        assert(live > 0);
+        const long before = live;
+        cxx::reclaim(10);
+        assert(live >= before - 10);
+        drain();
+        assert(live == 0);
+
+        {
+            Stack s;
+            for (int i = 0; i < 100; ++i) {
+                s.push(i, counted(i));
+            }
+            s.set_size_limit(10);
+            auto tx = s.transaction();
+            tx.push(1, counted(1));
+            tx.pop();
+        }
+        assert(cxx::reclaim() >= 1);
+        assert(live == 0 && !cxx::reclaim_pending());
+    }
+
+    template <typename Stack>
+    void test_immediate() {
+        {
+            Stack s;
+            s.push(1, counted(1));
+            Stack copy(s);
+            s.clear();
+        }
+        assert(live == 0 && !cxx::reclaim_pending());
+    }
+
+    void test_background() {
+        using Stack = cxx::stack<int, counted, cxx::deferred_reclamation>;
+        cxx::background_reclaimer reclaimer(std::chrono::milliseconds(1), 500);
+        for (int k = 0; k < 20; ++k) {
+            Stack s;
+            for (int i = 0; i < 2000; ++i) {
+                s.push(i % 100, counted(i));
+            }
+        }
+        for (int i = 0; i < 5000 && live > 0; ++i) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+        assert(live == 0);
+    }
+
+    // Reclamation does not change the behaviour of the stack.
+    void test_stack() {
+        using Stack = cxx::stack<test::key, test::value,
+                                 cxx::deferred_reclamation>;
+        Stack s;
+        s.push(1, 10);
+        s.push(2, 20);
+        const Stack copy(s);
+        test::check_strong(s, [](Stack& t) { t.push(1, 30); });
+        check(s, {{1, 30}, {2, 20}, {1, 10}});
+        check(copy, {{2, 20}, {1, 10}});
+        cxx::reclaim();
+    }
+}
+
+int main() {
+    test_deferred<cxx::stack<int, counted, cxx::deferred_reclamation>>();
+    test_deferred<cxx::stack<int, counted, cxx::slot_storage,
+                             cxx::hashed_index, cxx::deferred_reclamation>>();
+    test_deferred<cxx::stack<int, counted, cxx::lazy_removal<25>,
+                             cxx::deferred_reclamation>>();
+    test_immediate<cxx::stack<int, counted>>();
+    test_background();
+    test_stack();
+    drain();
+}
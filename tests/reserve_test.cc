@@ -0,0 +1,101 @@
+#define CXX_STACK_STATS
+#include "stack.h"
+#include "test_util.h"
+
+#include <cassert>
+
+using test::check;
+using test::contents_t;
+
+namespace {
+    template <typename Stack>
+    Stack make(int n) {
+        Stack s;
+        for (int i = 0; i < n; ++i) {
+            s.push(i % 10, i);
+        }
+        return s;
+    }
+
+    // Pushes of n elements with keys [0, n) after reserve(n, n) allocate
+    // nothing, when both policies allocate ahead.
+    template <typename Stack>
+    void test_reserve(bool allocates_ahead) {
+        Stack s;
+        s.reserve(1000, 1000);
+        cxx::reset_stack_stats();
+        for (int i = 0; i < 1000; ++i) {
+            s.push(i, i);
+        }
+        assert((cxx::get_stack_stats().bytes_allocated == 0) ==
+               allocates_ahead);
+
+        // clear(keep_capacity) keeps the room.
+        s.clear(cxx::keep_capacity);
+        check(s, {});
+        cxx::reset_stack_stats();
+        for (int i = 0; i < 1000; ++i) {
+            s.push(i, i);
+        }
+        assert((cxx::get_stack_stats().bytes_allocated == 0) ==
+               allocates_ahead);
+
+        for (int i = 0; i < 990; ++i) {
+            s.pop();
+        }
+        s.shrink_to_fit();
+        contents_t c;
+        for (int i = 9; i >= 0; --i) {
+            c.emplace_back(i, i);
+        }
+        check(s, c);
+    }
+
+    // reserve with nothing to make room for keeps shared data shared.
+    template <typename Stack>
+    void test_reserve_keeps_sharing(bool slots, bool table) {
+        for (bool keys : {false, true}) {
+            Stack s = make<Stack>(100);
+            const Stack copy(s);
+            cxx::reset_stack_stats();
+            s.reserve(0, 0);
+            s.reserve(50, 5);
+            assert(s.is_shared());
+            if (keys) {
+                s.reserve(0, 10000);
+            }
+            else {
+                s.reserve(10000, 0);
+            }
+            const bool copied = keys ? table : slots;
+            assert(s.is_shared() != copied);
+            assert(cxx::get_stack_stats().cow_copies == (copied ? 1 : 0));
+            assert(cxx::get_stack_stats().rollbacks == 0);
+            check(copy, test::contents(s));
+        }
+
+        // A moved-from stack has no data.
+        Stack s = make<Stack>(1);
+        Stack moved(std::move(s));
+        s.reserve(0, 0);
+        check(s, {});
+        s.reserve(10, 10);
+        s.push(1, 1);
+        check(s, {{1, 1}});
+    }
+
+    // Whether the storage and index policies allocate ahead.
+    template <typename... Options>
+    void test_all(bool slots, bool table) {
+        test_reserve<cxx::stack<int, int, Options...>>(slots && table);
+        test_reserve_keeps_sharing<cxx::stack<int, int, Options...>>(slots,
+                                                                     table);
+    }
+}
+
+int main() {
+    test_all<>(false, false);
+    test_all<cxx::hashed_index>(false, true);
+    test_all<cxx::slot_storage>(true, false);
+    test_all<cxx::slot_storage, cxx::hashed_index>(true, true);
+}
@@ -0,0 +1,199 @@
+#include "sharded_stack.h"
+#include "test_util.h"
+
+#include <cassert>
+#include <random>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+
+using test::contents_t;
+using test::plain;
+
+namespace {
+    template <typename Fn>
+    bool rejects(Fn fn) {
+        try {
+            fn();
+        }
+        catch (std::invalid_argument&) {
+            return true;
+        }
+        return false;
+    }
+
+    // Checks size, front, count(k) and front(k) for keys below n_keys
+    // against the elements c, with throwing turned off.
+    template <typename Stack>
+    void check(const Stack& s, const contents_t& c, int n_keys) {
+        const long saved = test::countdown;
+        test::countdown = 0;
+        assert(s.size() == c.size());
+        if (c.empty()) {
+            assert(rejects([&] { s.front(); }));
+        }
+        else {
+            const auto top = s.front();
+            assert(plain(top.first) == c.front().first);
+            assert(plain(top.second) == c.front().second);
+        }
+        for (int k = 0; k < n_keys; ++k) {
+            size_t n = 0;
+            const std::pair<int, int>* newest = nullptr;
+            for (const auto& e : c) {
+                if (e.first == k && n++ == 0) {
+                    newest = &e;
+                }
+            }
+            assert(s.count(k) == n);
+            if (newest) {
+                assert(plain(s.front(k)) == newest->second);
+            }
+            else {
+                assert(rejects([&] { s.front(k); }));
+            }
+        }
+        test::countdown = saved;
+    }
+
+    // Runs op(s) with an error injected at the 1st, 2nd... throwing
+    // operation until it succeeds, and checks that failures leave s as c.
+    template <typename Stack, typename Op>
+    size_t check_strong(Stack& s, const contents_t& c, int n_keys, Op op) {
+        for (long n = 1;; ++n) {
+            test::countdown = n;
+            try {
+                op(s);
+                test::countdown = 0;
+                return static_cast<size_t>(n - 1);
+            }
+            catch (const test::injected_error&) {
+                test::countdown = 0;
+                check(s, c, n_keys);
+            }
+        }
+    }
+
+    void model_pop(contents_t& m, int k) {
+        for (auto it = m.begin(); it != m.end(); ++it) {
+            if (it->first == k) {
+                m.erase(it);
+                return;
+            }
+        }
+    }
+
+    // Random operations on one thread against a model. pop() and front()
+    // must find the newest element over all shards.
+    template <typename Stack, bool Strong>
+    void test_differential(unsigned seed, int steps, size_t shards) {
+        constexpr int n_keys = 16;
+        std::mt19937 gen(seed);
+        auto rand = [&gen](int n) {
+            return static_cast<int>(gen() % static_cast<unsigned>(n));
+        };
+        Stack s(shards);
+        contents_t m;
+        auto run = [&](auto op) {
+            if constexpr (Strong) {
+                check_strong(s, m, n_keys, op);
+            }
+            else {
+                op(s);
+            }
+        };
+        for (int step = 0; step < steps; ++step) {
+            const int k = rand(n_keys), v = step;
+            switch (rand(6)) {
+                case 0: case 1: case 2:
+                    run([k, v](Stack& t) { t.push(k, v); });
+                    m.insert(m.begin(), {k, v});
+                    break;
+                case 3:
+                    if (!m.empty()) {
+                        run([](Stack& t) { t.pop(); });
+                        m.erase(m.begin());
+                    }
+                    else {
+                        assert(rejects([&] { s.pop(); }));
+                    }
+                    break;
+                case 4:
+                    if (s.count(k) > 0) {
+                        run([k](Stack& t) { t.pop(k); });
+                        model_pop(m, k);
+                    }
+                    else {
+                        assert(rejects([&] { s.pop(k); }));
+                    }
+                    break;
+                default:
+                    if (rand(20) == 0) {
+                        s.clear();
+                        m.clear();
+                    }
+                    break;
+            }
+            check(s, m, n_keys);
+        }
+    }
+
+    // Writers push and pop their own keys in parallel; the order of
+    // elements of each key is kept.
+    void test_writers() {
+        constexpr int threads = 8, keys_per_thread = 4, rounds = 5000;
+        cxx::sharded_stack<int, int> s(4);
+        std::vector<std::thread> writers;
+        for (int t = 0; t < threads; ++t) {
+            writers.emplace_back([&s, t] {
+                for (int i = 0; i < rounds; ++i) {
+                    const int k = t * keys_per_thread + i % keys_per_thread;
+                    s.push(k, i);
+                    assert(s.front(k) == i);
+                    if (i % 3 == 2) {
+                        s.pop(k);
+                    }
+                }
+            });
+        }
+        // A reader of the whole stack runs meanwhile.
+        std::thread reader([&s] {
+            for (int i = 0; i < 1000; ++i) {
+                if (s.size() > 0) {
+                    const auto top = s.front();
+                    assert(top.first >= 0 &&
+                           top.first < threads * keys_per_thread);
+                }
+            }
+        });
+        for (auto& w : writers) {
+            w.join();
+        }
+        reader.join();
+
+        size_t total = 0;
+        for (int k = 0; k < threads * keys_per_thread; ++k) {
+            const size_t n = s.count(k);
+            total += n;
+            int newer = rounds;
+            for (size_t j = n; j > 0; --j) {
+                assert(s.front(k) < newer);
+                newer = s.front(k);
+                s.pop(k);
+            }
+            assert(s.count(k) == 0);
+        }
+        assert(total == static_cast<size_t>(threads) * (rounds - rounds / 3));
+        assert(s.size() == 0);
+    }
+}
+
+int main() {
+    test_differential<cxx::sharded_stack<int, int>, false>(1, 3000, 4);
+    test_differential<cxx::sharded_stack<int, int>, false>(2, 1000, 1);
+    test_differential<cxx::sharded_stack<int, int, cxx::slot_storage,
+                                         cxx::hashed_index>, false>(3, 2000, 7);
+    test_differential<cxx::sharded_stack<test::key, test::value>, true>(
+            4, 600, 4);
+    test_writers();
+}
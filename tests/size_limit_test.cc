@@ -0,0 +1,262 @@
+#include "stack.h"
+#include "test_util.h"
+
+#include <cassert>
+#include <random>
+#include <stdexcept>
+#include <utility>
+#include <vector>
+
+using test::check;
+using test::contents_t;
+
+namespace {
+    void model_pop(contents_t& m, int k) {
+        for (auto it = m.begin(); it != m.end(); ++it) {
+            if (it->first == k) {
+                m.erase(it);
+                return;
+            }
+        }
+    }
+
+    bool model_has(const contents_t& m, int k) {
+        for (const auto& e : m) {
+            if (e.first == k) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    void model_limit(contents_t& m, size_t limit) {
+        if (m.size() > limit) {
+            m.resize(limit);
+        }
+    }
+
+    template <typename Stack>
+    void test_evict() {
+        Stack s;
+        assert(s.size_limit() == Stack::no_size_limit);
+        s.set_size_limit(3);
+        for (int i = 0; i < 5; ++i) {
+            s.push(i % 2, i);
+        }
+        check(s, {{0, 4}, {1, 3}, {0, 2}});
+
+        // Chains which lost their oldest elements still pop from the top.
+        s.pop(0);
+        s.push(1, 5);
+        s.push(2, 6);
+        check(s, {{2, 6}, {1, 5}, {1, 3}});
+        s.pop(1);
+        s.pop(1);
+        check(s, {{2, 6}});
+
+        // The limit is copied, a lower one evicts at once.
+        s.push(3, 7);
+        s.push(4, 8);
+        Stack copy(s);
+        assert(copy.size_limit() == 3);
+        s.set_size_limit(1);
+        check(s, {{4, 8}});
+        check(copy, {{4, 8}, {3, 7}, {2, 6}});
+        copy.push(5, 9);
+        check(copy, {{5, 9}, {4, 8}, {3, 7}});
+
+        s.set_size_limit(Stack::no_size_limit);
+        for (int i = 0; i < 10; ++i) {
+            s.push(i, i);
+        }
+        assert(s.size() == 11);
+
+        bool caught = false;
+        try {
+            s.set_size_limit(0);
+        }
+        catch (std::invalid_argument&) {
+            caught = true;
+        }
+        assert(caught && s.size_limit() == Stack::no_size_limit);
+    }
+
+    // Batches push all elements first, then evict, also their own ones.
+    template <typename Stack>
+    void test_batches() {
+        Stack s;
+        s.set_size_limit(4);
+        s.push(1, 1);
+        s.push(2, 2);
+        const std::vector<std::pair<int, int>> batch = {
+                {3, 3}, {1, 4}, {3, 5}, {4, 6}, {3, 7}};
+        s.push_range(batch.begin(), batch.end());
+        check(s, {{3, 7}, {4, 6}, {3, 5}, {1, 4}});
+
+        // Keys of both stacks, whose chains in s lost their bottoms.
+        Stack other;
+        other.push(1, 8);
+        other.push(3, 9);
+        s.splice_on_top(std::move(other));
+        check(s, {{3, 9}, {1, 8}, {3, 7}, {4, 6}});
+        check(other, {});
+        s.pop(3);
+        s.pop(3);
+        check(s, {{1, 8}, {4, 6}});
+
+        Stack large;
+        for (int i = 0; i < 10; ++i) {
+            large.push(i % 3, 10 + i);
+        }
+        s.splice_on_top(std::move(large));
+        check(s, {{0, 19}, {2, 18}, {1, 17}, {0, 16}});
+    }
+
+    /* Random operations under a size limit compared with a model, which
+    drops its oldest elements after each one. With Strong, operations are
+    run by check_strong.
+    */
+    template <typename Stack, bool Strong>
+    void test_differential(unsigned seed, int steps) {
+        std::mt19937 gen(seed);
+        auto rand = [&gen](int n) {
+            return static_cast<int>(gen() % static_cast<unsigned>(n));
+        };
+        auto run = [](Stack& s, auto op) {
+            if constexpr (Strong) {
+                test::check_strong(s, op);
+            }
+            else {
+                op(s);
+            }
+        };
+
+        Stack s;
+        size_t limit = 20;
+        s.set_size_limit(limit);
+        contents_t m;
+        Stack copy;
+        contents_t copy_m;
+        for (int step = 0; step < steps; ++step) {
+            const int k = rand(8), v = step;
+            switch (rand(10)) {
+                case 0: case 1: case 2:
+                    run(s, [k, v](Stack& t) { t.push(k, v); });
+                    m.insert(m.begin(), {k, v});
+                    break;
+                case 3:
+                    if (!m.empty()) {
+                        run(s, [](Stack& t) { t.pop(); });
+                        m.erase(m.begin());
+                    }
+                    break;
+                case 4:
+                    if (model_has(m, k)) {
+                        run(s, [k](Stack& t) { t.pop(k); });
+                        model_pop(m, k);
+                    }
+                    break;
+                case 5: {
+                    std::vector<std::pair<int, int>> batch;
+                    const int n = rand(8);
+                    for (int i = 0; i < n; ++i) {
+                        batch.emplace_back(rand(8), v * 10 + i);
+                        m.insert(m.begin(), batch.back());
+                    }
+                    run(s, [&batch](Stack& t) {
+                        t.push_range(batch.begin(), batch.end());
+                    });
+                    break;
+                }
+                case 6: {
+                    Stack other;
+                    const int n = rand(8);
+                    for (int i = 0; i < n; ++i) {
+                        other.push(rand(8), -v * 10 - i);
+                    }
+                    const contents_t other_m = test::contents(other);
+                    run(s, [&other](Stack& t) {
+                        t.splice_on_top(std::move(other));
+                    });
+                    m.insert(m.begin(), other_m.begin(), other_m.end());
+                    break;
+                }
+                case 7:
+                    limit = static_cast<size_t>(1 + rand(30));
+                    run(s, [limit](Stack& t) { t.set_size_limit(limit); });
+                    break;
+                case 8:
+                    copy = s;
+                    copy_m = m;
+                    break;
+                default:
+                    if (model_has(m, k)) {
+                        run(s, [k, v](Stack& t) {
+                            t.modify(k, [v](auto& x) { x = v; });
+                        });
+                        for (auto& e : m) {
+                            if (e.first == k) {
+                                e.second = v;
+                                break;
+                            }
+                        }
+                    }
+                    break;
+            }
+            model_limit(m, limit);
+            check(s, m);
+            check(copy, copy_m);
+        }
+    }
+
+    // A lower limit evicts with the strong guarantee, also when its keys
+    // are looked up before anything is removed.
+    template <typename Stack>
+    void test_strong() {
+        for (bool shared : {false, true}) {
+            Stack s;
+            contents_t c;
+            for (int i = 0; i < 30; ++i) {
+                s.push(i % 7, i);
+                c.insert(c.begin(), {i % 7, i});
+            }
+            s.pop(3);
+            model_pop(c, 3);
+            const Stack copy(s);
+            if (!shared) {
+                s.front();
+            }
+            const size_t failures = test::check_strong(
+                    s, [](Stack& t) { t.set_size_limit(10); });
+            assert(failures > 0);
+            model_limit(c, 10);
+            check(s, c);
+            assert(copy.size() == 29);
+            assert(copy.size_limit() == Stack::no_size_limit);
+
+            // push evicting one element.
+            test::check_strong(s, [](Stack& t) { t.push(3, 100); });
+            c.insert(c.begin(), {3, 100});
+            model_limit(c, 10);
+            check(s, c);
+        }
+    }
+
+    template <typename... Options>
+    void test_all() {
+        test_evict<cxx::stack<int, int, Options...>>();
+        test_batches<cxx::stack<int, int, Options...>>();
+        test_differential<cxx::stack<int, int, Options...>, false>(1, 3000);
+        test_differential<cxx::stack<test::key, test::value, Options...>,
+                          true>(2, 500);
+        test_strong<cxx::stack<test::key, test::value, Options...>>();
+    }
+}
+
+int main() {
+    test_all<>();
+    test_all<cxx::slot_storage>();
+    test_all<cxx::hashed_index>();
+    test_all<cxx::lazy_removal<25>>();
+    test_all<cxx::slot_storage, cxx::hashed_index, cxx::lazy_removal<50>>();
+}
@@ -0,0 +1,209 @@
+#include "stack.h"
+#include "stack_snapshot.h"
+#include "test_util.h"
+
+#include <cassert>
+#include <cstddef>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <map>
+#include <span>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <system_error>
+#include <vector>
+
+using test::check;
+using test::contents_t;
+
+namespace {
+    template <typename Stack>
+    Stack make(contents_t& c) {
+        Stack s;
+        c.clear();
+        for (int i = 0; i < 500; ++i) {
+            s.push(i * 13 % 71, -i);
+            c.insert(c.begin(), {i * 13 % 71, -i});
+        }
+        s.pop(5);
+        s.pop(5);
+        int popped = 0;
+        for (auto it = c.begin(); it != c.end() && popped < 2;) {
+            if (it->first == 5) {
+                it = c.erase(it);
+                ++popped;
+            }
+            else {
+                ++it;
+            }
+        }
+        return s;
+    }
+
+    template <typename Stack>
+    std::string serialized(const Stack& s) {
+        std::ostringstream out;
+        cxx::serialize(s, out);
+        return out.str();
+    }
+
+    // Bytes of a serialized stack, aligned for stack_view.
+    struct aligned_bytes {
+        std::vector<std::max_align_t> storage;
+        std::span<const std::byte> bytes;
+
+        explicit aligned_bytes(const std::string& s)
+                : storage(s.size() / sizeof(std::max_align_t) + 1) {
+            std::memcpy(storage.data(), s.data(), s.size());
+            bytes = {reinterpret_cast<const std::byte*>(storage.data()),
+                     s.size()};
+        }
+    };
+
+    template <typename From, typename To>
+    void test_load() {
+        contents_t c;
+        const From s = make<From>(c);
+        const aligned_bytes data(serialized(s));
+        const To loaded = cxx::load_stack<To>(data.bytes);
+        check(loaded, c);
+
+        // Unaligned data is fine for load_stack.
+        std::vector<std::byte> shifted(data.bytes.size() + 1);
+        std::memcpy(shifted.data() + 1, data.bytes.data(), data.bytes.size());
+        check(cxx::load_stack<To>(std::span<const std::byte>(shifted).subspan(1)),
+              c);
+
+        const To empty = cxx::load_stack<To>(
+                aligned_bytes(serialized(From())).bytes);
+        check(empty, {});
+    }
+
+    template <typename View>
+    void check_view(const View& v, const contents_t& c) {
+        assert(v.size() == c.size());
+        assert(v.front().first == c.front().first);
+        assert(v.front().second == c.front().second);
+        std::map<int, std::pair<size_t, int>> keys;
+        for (auto it = c.rbegin(); it != c.rend(); ++it) {
+            auto& [n, top] = keys[it->first];
+            ++n;
+            top = it->second;
+        }
+        auto key = keys.begin();
+        for (auto it = v.cbegin(); it != v.cend(); ++it, ++key) {
+            assert(*it == key->first);
+            assert(v.count(*it) == key->second.first);
+            assert(v.front(*it) == key->second.second);
+        }
+        assert(key == keys.end());
+        assert(v.count(-1) == 0);
+        bool caught = false;
+        try {
+            v.front(-1);
+        }
+        catch (std::invalid_argument&) {
+            caught = true;
+        }
+        assert(caught);
+    }
+
+    void test_view() {
+        contents_t c;
+        const cxx::stack<int, int> s = make<cxx::stack<int, int>>(c);
+        const aligned_bytes data(serialized(s));
+        check_view(cxx::stack_view<int, int>(data.bytes), c);
+#if __has_include(<sys/mman.h>)
+        const std::string path = "snapshot_test.bin";
+        {
+            std::ofstream file(path, std::ios::binary);
+            cxx::serialize(s, file);
+        }
+        {
+            const cxx::mapped_stack<int, int> mapped(path.c_str());
+            check_view(mapped.view(), c);
+            check(cxx::load_stack<cxx::stack<int, int>>(mapped.bytes()), c);
+        }
+        std::remove(path.c_str());
+        bool caught = false;
+        try {
+            cxx::mapped_stack<int, int> missing("no/such/snapshot.bin");
+        }
+        catch (std::system_error& e) {
+            caught = e.code() == std::errc::no_such_file_or_directory;
+        }
+        assert(caught);
+        {
+            std::ofstream file(path, std::ios::binary);
+        }
+        caught = false;
+        try {
+            cxx::mapped_stack<int, int> empty(path.c_str());
+        }
+        catch (std::system_error& e) {
+            caught = e.code() == std::errc::invalid_argument;
+        }
+        std::remove(path.c_str());
+        assert(caught);
+#endif
+    }
+
+    // Sections are aligned to 16 bytes only, stack_view could not read
+    // wider types in place.
+    struct alignas(32) wide {
+        int x;
+    };
+    static_assert(cxx::detail::snapshot_type<long double>);
+    static_assert(!cxx::detail::snapshot_type<wide>);
+    static_assert(!cxx::detail::snapshot_type<std::string>);
+
+    template <typename Fn>
+    bool rejects(Fn fn) {
+        try {
+            fn();
+        }
+        catch (std::invalid_argument&) {
+            return true;
+        }
+        return false;
+    }
+
+    void test_corrupt() {
+        contents_t c;
+        const std::string good = serialized(make<cxx::stack<int, int>>(c));
+        using Stack = cxx::stack<int, int>;
+        const aligned_bytes truncated(good.substr(0, good.size() / 2));
+        assert(rejects([&] { cxx::load_stack<Stack>(truncated.bytes); }));
+        assert(rejects([&] {
+            cxx::stack_view<int, int> v(truncated.bytes);
+        }));
+        std::string bad_magic = good;
+        bad_magic[0] ^= 1;
+        const aligned_bytes magic(bad_magic);
+        assert(rejects([&] { cxx::load_stack<Stack>(magic.bytes); }));
+        // Other value type.
+        const aligned_bytes data(good);
+        assert(rejects([&] {
+            cxx::load_stack<cxx::stack<int, long long>>(data.bytes);
+        }));
+        assert(rejects([&] { cxx::load_stack<Stack>({}); }));
+
+        std::ostringstream failed;
+        failed.setstate(std::ios::badbit);
+        assert(rejects([&] { cxx::serialize(Stack(), failed); }));
+    }
+}
+
+int main() {
+    test_load<cxx::stack<int, int>, cxx::stack<int, int>>();
+    test_load<cxx::stack<int, int>,
+              cxx::stack<int, int, cxx::slot_storage, cxx::hashed_index>>();
+    test_load<cxx::stack<int, int, cxx::hashed_index>,
+              cxx::stack<int, int>>();
+    test_load<cxx::stack<int, int, cxx::lazy_removal<50>>,
+              cxx::stack<int, int, cxx::slot_storage>>();
+    test_view();
+    test_corrupt();
+}
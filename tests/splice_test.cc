@@ -0,0 +1,143 @@
+#include "stack.h"
+#include "test_util.h"
+
+#include <cassert>
+#include <stdexcept>
+#include <string>
+
+using test::check;
+using test::contents_t;
+
+namespace {
+    template <typename Stack>
+    void test_splice() {
+        Stack a, b;
+        a.push(1, 10);
+        a.push(2, 20);
+        b.push(2, 30);
+        b.push(3, 40);
+        b.push(2, 50);
+        a.splice_on_top(std::move(b));
+        check(a, {{2, 50}, {3, 40}, {2, 30}, {2, 20}, {1, 10}});
+        check(b, {});
+
+        // The chains joined at the bottom of those of b.
+        a.pop(2);
+        a.pop(2);
+        check(a, {{3, 40}, {2, 20}, {1, 10}});
+
+        Stack empty;
+        a.splice_on_top(std::move(empty));
+        check(a, {{3, 40}, {2, 20}, {1, 10}});
+        empty.splice_on_top(std::move(a));
+        check(empty, {{3, 40}, {2, 20}, {1, 10}});
+        check(a, {});
+
+        bool caught = false;
+        try {
+            empty.splice_on_top(std::move(empty));
+        }
+        catch (std::invalid_argument&) {
+            caught = true;
+        }
+        assert(caught);
+    }
+
+    // Copies which share data take the path of push, and keep the source.
+    template <typename Stack>
+    void test_splice_shared() {
+        Stack a, b;
+        a.push(1, 10);
+        b.push(1, 20);
+        b.push(2, 30);
+        const Stack a_copy(a), b_copy(b);
+        a.splice_on_top(std::move(b));
+        check(a, {{2, 30}, {1, 20}, {1, 10}});
+        check(b, {});
+        check(a_copy, {{1, 10}});
+        check(b_copy, {{2, 30}, {1, 20}});
+    }
+
+    template <typename Stack>
+    void test_splice_strong() {
+        for (bool shared : {false, true}) {
+            Stack a, b;
+            for (int i = 0; i < 20; ++i) {
+                a.push(i % 7, i);
+                b.push(i % 5 + 3, 100 + i);
+            }
+            const contents_t a_before = test::contents(a);
+            const Stack a_copy(a);
+            if (!shared) {
+                a.front(); // Unshareable, so a_copy is a deep copy.
+            }
+            const contents_t all = [&] {
+                Stack t(a), u(b);
+                t.splice_on_top(std::move(u));
+                return test::contents(t);
+            }();
+            const contents_t other = test::contents(b);
+            test::check_strong(a, [&](Stack& s) {
+                Stack moved(b);
+                b.front(); // Not shared, for the splice fast path.
+                try {
+                    s.splice_on_top(std::move(b));
+                }
+                catch (...) {
+                    check(b, other);
+                    throw;
+                }
+                b = Stack(moved);
+            });
+            check(a, all);
+            check(a_copy, a_before);
+        }
+    }
+
+    // Keys held by shared_ptr are kept once, also for keys in both stacks.
+    template <typename Stack>
+    void test_splice_one_key_copy() {
+        const std::string k(40, 'k'), l(40, 'l');
+        Stack a, b;
+        a.push(k, 1);
+        b.push(k, 2);
+        b.push(l, 3);
+        b.push(k, 4);
+        a.splice_on_top(std::move(b));
+        const std::string* indexed = nullptr;
+        for (auto it = a.cbegin(); it != a.cend(); ++it) {
+            if (*it == k) {
+                indexed = &*it;
+            }
+        }
+        assert(indexed != nullptr);
+        size_t seen = 0;
+        for (const auto& [key, value] : a.elements()) {
+            if (key == k) {
+                assert(&key == indexed);
+                ++seen;
+            }
+        }
+        assert(seen == 3);
+        assert(&a.front().first == indexed);
+    }
+
+    template <typename... Options>
+    void test_all() {
+        using plain = cxx::stack<int, int, Options...>;
+        using throwing = cxx::stack<test::key, test::value, Options...>;
+        using strings = cxx::stack<std::string, int, Options...>;
+        test_splice<plain>();
+        test_splice<throwing>();
+        test_splice_shared<plain>();
+        test_splice_strong<throwing>();
+        test_splice_one_key_copy<strings>();
+    }
+}
+
+int main() {
+    test_all<>();
+    test_all<cxx::slot_storage>();
+    test_all<cxx::hashed_index>();
+    test_all<cxx::lazy_removal<50>>();
+}
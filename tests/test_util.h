@@ -0,0 +1,169 @@
+#ifndef TEST_UTIL_H
+#define TEST_UTIL_H
+
+/* Helpers of the assertion checks in tests/, each of which is a program
+built on its own (see README).
+*/
+#include <cassert>
+#include <cstddef>
+#include <functional>
+#include <map>
+#include <stdexcept>
+#include <utility>
+#include <vector>
+
+namespace test {
+    // Operations of key and value below throw after a countdown.
+    struct injected_error : std::runtime_error {
+        injected_error() : std::runtime_error("injected") {}
+    };
+
+    inline long countdown = 0; // 0: never throw.
+
+    inline void may_throw() {
+        if (countdown > 0 && --countdown == 0) {
+            throw injected_error();
+        }
+    }
+
+    // Value whose copies may throw.
+    struct value {
+        int v = 0;
+        value() = default;
+        value(int x) : v(x) {}
+        value(const value& o) : v(o.v) {
+            may_throw();
+        }
+        value& operator=(const value& o) {
+            may_throw();
+            v = o.v;
+            return *this;
+        }
+        friend bool operator==(const value&, const value&) = default;
+    };
+
+    // Key whose copies, comparisons and hashes may throw.
+    struct key {
+        int k = 0;
+        key() = default;
+        key(int x) : k(x) {}
+        key(const key& o) : k(o.k) {
+            may_throw();
+        }
+        key& operator=(const key& o) {
+            may_throw();
+            k = o.k;
+            return *this;
+        }
+        friend bool operator<(const key& a, const key& b) {
+            may_throw();
+            return a.k < b.k;
+        }
+        friend bool operator==(const key& a, const key& b) {
+            may_throw();
+            return a.k == b.k;
+        }
+    };
+
+    inline int plain(int x) {
+        return x;
+    }
+    inline int plain(const value& x) {
+        return x.v;
+    }
+    inline int plain(const key& x) {
+        return x.k;
+    }
+
+    using contents_t = std::vector<std::pair<int, int>>;
+
+    // Elements from the top, with throwing turned off.
+    template <typename Stack>
+    contents_t contents(const Stack& s) {
+        const long saved = countdown;
+        countdown = 0;
+        contents_t c;
+        for (const auto& [k, v] : s.elements()) {
+            c.emplace_back(plain(k), plain(v));
+        }
+        countdown = saved;
+        return c;
+    }
+
+    // Elements from the top, by popping a copy of s, for stacks without
+    // elements() (persistent_stack).
+    template <typename Stack>
+    contents_t popped(const Stack& s) {
+        const long saved = countdown;
+        countdown = 0;
+        contents_t c;
+        Stack copy(s);
+        while (copy.size() > 0) {
+            const auto& top = static_cast<const Stack&>(copy).front();
+            c.emplace_back(plain(top.first), plain(top.second));
+            copy.pop();
+        }
+        countdown = saved;
+        return c;
+    }
+
+    // Checks size, count and front(k) of s against its elements, which
+    // must be c.
+    template <typename Stack>
+    void check(const Stack& s, const contents_t& c) {
+        const long saved = countdown;
+        countdown = 0;
+        assert(contents(s) == c);
+        assert(s.size() == c.size());
+        std::map<int, std::pair<size_t, int>> keys;
+        for (auto it = c.rbegin(); it != c.rend(); ++it) {
+            auto& [n, top] = keys[it->first];
+            ++n;
+            top = it->second;
+        }
+        size_t distinct = 0;
+        for (auto it = s.cbegin(); it != s.cend(); ++it) {
+            assert(keys.count(plain(*it)) == 1);
+            ++distinct;
+        }
+        assert(distinct == keys.size());
+        for (const auto& [k, entry] : keys) {
+            assert(s.count(k) == entry.first);
+            assert(plain(s.front(k)) == entry.second);
+        }
+        if (!c.empty()) {
+            assert(plain(s.front().first) == c.front().first);
+        }
+        countdown = saved;
+    }
+
+    /* Runs op(s) with an error injected at the 1st, 2nd... throwing
+    operation until it succeeds, and checks after each failure that s
+    was left unchanged. Returns the number of failures.
+    */
+    template <typename Stack, typename Op>
+    size_t check_strong(Stack& s, Op op) {
+        const contents_t before = contents(s);
+        for (long n = 1;; ++n) {
+            countdown = n;
+            try {
+                op(s);
+                countdown = 0;
+                return static_cast<size_t>(n - 1);
+            }
+            catch (const injected_error&) {
+                countdown = 0;
+                check(s, before);
+            }
+        }
+    }
+}
+
+template <> struct std::hash<test::key> {
+    size_t operator()(const test::key& k) const {
+        test::may_throw();
+        return std::hash<int>()(k.k);
+    }
+};
+
+#endif //TEST_UTIL_H
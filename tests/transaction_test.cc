@@ -0,0 +1,151 @@
+#include "stack.h"
+#include "test_util.h"
+
+#include <cassert>
+#include <stdexcept>
+#include <string>
+
+using test::check;
+using test::contents_t;
+
+namespace {
+    template <typename Stack>
+    Stack make() {
+        Stack s;
+        s.push(1, 10);
+        s.push(2, 20);
+        s.push(1, 30);
+        return s;
+    }
+
+    template <typename Stack>
+    void test_commit() {
+        Stack s = make<Stack>();
+        const Stack copy(s);
+        {
+            auto tx = s.transaction();
+            tx.push(3, 40);
+            tx.pop(1);
+            tx.pop();
+            tx.push(1, 50);
+            tx.pop(2);
+            tx.push(2, 60);
+            // The stack may be read during the transaction.
+            check(s, {{2, 60}, {1, 50}, {1, 10}});
+            tx.commit();
+        }
+        check(s, {{2, 60}, {1, 50}, {1, 10}});
+        check(copy, {{1, 30}, {2, 20}, {1, 10}});
+
+        auto tx = s.transaction();
+        tx.commit();
+        bool caught = false;
+        try {
+            tx.push(1, 1);
+        }
+        catch (std::invalid_argument&) {
+            caught = true;
+        }
+        assert(caught);
+
+        // A finished transaction is reported before an empty stack.
+        Stack empty;
+        auto done = empty.transaction();
+        done.commit();
+        caught = false;
+        try {
+            done.pop();
+        }
+        catch (std::invalid_argument& e) {
+            caught = std::string(e.what()) ==
+                     "Error: transaction is not active";
+        }
+        assert(caught);
+    }
+
+    // Destruction without commit undoes all operations.
+    template <typename Stack>
+    void test_roll_back() {
+        for (bool shared : {false, true}) {
+            Stack s = make<Stack>();
+            const Stack copy(s);
+            if (!shared) {
+                s.front();
+            }
+            {
+                auto tx = s.transaction();
+                tx.pop(2);
+                tx.pop();
+                tx.pop();
+                tx.push(2, 70);
+                tx.push(5, 80);
+                tx.pop(5);
+            }
+            check(s, {{1, 30}, {2, 20}, {1, 10}});
+            check(copy, {{1, 30}, {2, 20}, {1, 10}});
+
+            // A failing operation leaves the earlier ones to be undone.
+            bool caught = false;
+            try {
+                auto tx = s.transaction();
+                tx.pop(1);
+                tx.push(3, 1);
+                tx.pop(4);
+                tx.commit();
+            }
+            catch (std::invalid_argument&) {
+                caught = true;
+            }
+            assert(caught);
+            check(s, {{1, 30}, {2, 20}, {1, 10}});
+            s.push(4, 90);
+            check(s, {{4, 90}, {1, 30}, {2, 20}, {1, 10}});
+        }
+    }
+
+    // Strong guarantee for the whole group under injected exceptions.
+    template <typename Stack>
+    void test_strong() {
+        for (bool shared : {false, true}) {
+            Stack s = make<Stack>();
+            const Stack copy(s);
+            if (!shared) {
+                s.front();
+            }
+            const size_t failures = test::check_strong(s, [](Stack& t) {
+                auto tx = t.transaction();
+                for (int i = 0; i < 10; ++i) {
+                    tx.push(i % 3, i);
+                }
+                tx.pop(1);
+                tx.pop();
+                tx.commit();
+            });
+            assert(failures > 0);
+            contents_t c;
+            for (int i = 8; i >= 0; --i) {
+                if (i != 7) {
+                    c.emplace_back(i % 3, i);
+                }
+            }
+            c.insert(c.end(), {{1, 30}, {2, 20}, {1, 10}});
+            check(s, c);
+            check(copy, {{1, 30}, {2, 20}, {1, 10}});
+        }
+    }
+
+    template <typename... Options>
+    void test_all() {
+        test_commit<cxx::stack<int, int, Options...>>();
+        test_roll_back<cxx::stack<int, int, Options...>>();
+        test_strong<cxx::stack<int, test::value, Options...>>();
+    }
+}
+
+int main() {
+    test_all<>();
+    test_all<cxx::slot_storage>();
+    test_all<cxx::hashed_index>();
+    test_all<cxx::lazy_removal<25>>();
+    test_all<cxx::slot_storage, cxx::hashed_index, cxx::lazy_removal<50>>();
+}